@@ -4,16 +4,134 @@
 #include "modbus_io.h"
 #include "modbus_constants.h"
 
+// Default maps, one region from address 0 each until modbus_controller_map() replaces them. Set to 0 to leave a table unmapped & save the RAM
 // Max 2^13 - 1
+#ifndef MODBUS_CONTROLLER_COILS_BYTE_SIZE
 #define MODBUS_CONTROLLER_COILS_BYTE_SIZE 			128
+#endif
+#ifndef MODBUS_CONTROLLER_DISCRETE_INPUTS_BYTE_SIZE
 #define MODBUS_CONTROLLER_DISCRETE_INPUTS_BYTE_SIZE 128
+#endif
 
 // Max 2^16 - 1
+#ifndef MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE
 #define MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE 	128
+#endif
+#ifndef MODBUS_CONTROLLER_INPUT_REGISTERS_SIZE
 #define MODBUS_CONTROLLER_INPUT_REGISTERS_SIZE 		128
+#endif
+
+// Address space is split into 2^(16 - shift) pages, each remembering first region reaching into it. Lookups are constant time
+// while regions don't share pages, index costs one byte per page per table
+#ifndef MODBUS_CONTROLLER_PAGE_SHIFT
+#define MODBUS_CONTROLLER_PAGE_SHIFT 				10
+#endif
+#define MODBUS_CONTROLLER_PAGES 					(1UL << (16 - MODBUS_CONTROLLER_PAGE_SHIFT))
+
+// Data tables
+#define MODBUS_CONTROLLER_COILS 					0
+#define MODBUS_CONTROLLER_DISCRETE_INPUTS 			1
+#define MODBUS_CONTROLLER_HOLDING_REGISTERS 		2
+#define MODBUS_CONTROLLER_INPUT_REGISTERS 			3
+#define MODBUS_CONTROLLER_TABLES 					4
+
+// Region access, master gets illegal data address for anything else
+#define MODBUS_CONTROLLER_REGION_READ 				0x01
+#define MODBUS_CONTROLLER_REGION_WRITE 				0x02	// Coils & holding registers only
+
+// Standard function codes served, set to 0 to compile out
+#ifndef MODBUS_CONTROLLER_READ_COILS
+#define MODBUS_CONTROLLER_READ_COILS 				1
+#endif
+#ifndef MODBUS_CONTROLLER_READ_DISCRETE_INPUTS
+#define MODBUS_CONTROLLER_READ_DISCRETE_INPUTS 		1
+#endif
+#ifndef MODBUS_CONTROLLER_READ_HOLDING_REGISTERS
+#define MODBUS_CONTROLLER_READ_HOLDING_REGISTERS 	1
+#endif
+#ifndef MODBUS_CONTROLLER_READ_INPUT_REGISTERS
+#define MODBUS_CONTROLLER_READ_INPUT_REGISTERS 		1
+#endif
+#ifndef MODBUS_CONTROLLER_WRITE_SINGLE_COIL
+#define MODBUS_CONTROLLER_WRITE_SINGLE_COIL 		1
+#endif
+#ifndef MODBUS_CONTROLLER_WRITE_SINGLE_REGISTER
+#define MODBUS_CONTROLLER_WRITE_SINGLE_REGISTER 	1
+#endif
+#ifndef MODBUS_CONTROLLER_DIAGNOSTICS
+#define MODBUS_CONTROLLER_DIAGNOSTICS 				1
+#endif
+#ifndef MODBUS_CONTROLLER_GET_COMM_EVENT_COUNTER
+#define MODBUS_CONTROLLER_GET_COMM_EVENT_COUNTER 	1
+#endif
+#ifndef MODBUS_CONTROLLER_WRITE_MULTIPLE_COILS
+#define MODBUS_CONTROLLER_WRITE_MULTIPLE_COILS 		1
+#endif
+#ifndef MODBUS_CONTROLLER_WRITE_MULTIPLE_REGISTERS
+#define MODBUS_CONTROLLER_WRITE_MULTIPLE_REGISTERS 	1
+#endif
+
+// Contiguous block of addresses backed by application storage. Requests may run across regions that follow each other without a gap
+typedef struct {
+	uint16_t base;		// First address
+	uint16_t length;	// Coils, inputs or registers
+	void *storage;		// uint32_t[(length + 31) / 32] packed LSB first for coils & inputs, uint16_t[length] word aligned for registers
+	uint8_t flags;		// MODBUS_CONTROLLER_REGION_READ/WRITE
+	uint32_t *dirty;	// uint32_t[(length + 31) / 32], bit set for every coil master flipped or register master wrote. NULL doesn't track
+	void *shadow;		// Second bank like storage for modbus_controller_begin_update(), NULL for single bank
+	volatile bool commit_pending;	// Private
+} modbus_controller_region;
+
+// One per Modbus port, all of them serve the same coils, inputs & registers. Fields are private to modbus_controller, apart from buffers function handlers work on
+typedef struct {
+	modbus_io_t *io;
+	uint8_t address;
+
+	uint16_t read_buffer_size;
+	uint8_t *read_buffer;	// Borrowed from modbus_io for the duration of a tick
+
+	uint16_t write_buffer_size;
+	uint8_t write_buffer[MODBUS_IO_BUFFER_SIZE];
+
+	// Diagnostic counters, 16 bit and wrapping as spec has them. Line counters are kept by modbus_io, cleared by remembering where they stood
+	uint16_t crc_errors, exceptions, server_messages, no_responses, comm_events;
+	modbus_io_line_stats line_cleared;
+	bool replied;
+} modbus_server_t;
+
+// Handler gets request in read_buffer, CRC included in read_buffer_size, and builds reply after address & function already in write_buffer
+typedef void (*modbus_controller_handler)(modbus_server_t *server);
+
+typedef struct {
+	modbus_controller_handler handler;
+	uint16_t min_request_bytes;	// Without CRC, shorter requests are ignored without reply
+	bool speculative;			// No side effects, may run before MODBUS_IO_SPECULATIVE confirms frame
+} modbus_controller_function;
+
+void modbus_controller_init(modbus_server_t *server, modbus_io_t *io, uint8_t address); // Sets port and address, io must already be initialized
+
+// Call every tick, checks if Modbus message is available on server's port and processes it. Returns true if a frame was taken off the queue, call again while it does
+// With MODBUS_IO_PENDSV it runs in PendSV_Handler instead, so don't touch coils & registers from main loop without masking PendSV, or double bank them
+bool modbus_controller_tick(modbus_server_t *server);
+
+// Serves a user-defined function code (65-72, 100-110) on every port. Returns false for any other code
+bool modbus_controller_register_function(uint8_t function, modbus_controller_handler handler, uint16_t min_request_bytes, bool speculative);
+
+// Serves table (MODBUS_CONTROLLER_COILS...) from regions, sorted by base & not overlapping, max 254 of them. Regions must stay in place while mapped
+// Returns false and keeps the old map if they aren't. Map before traffic starts, serving isn't locked against it
+bool modbus_controller_map(uint8_t table, modbus_controller_region *regions, uint8_t count);
+
+// Finds first dirty coil or register at or after *address, clears its flag and leaves its address in *address. False once there are none left
+// Skips clean words whole, safe against handlers running in PendSV. Start from 0 and call again with *address until it returns false
+bool modbus_controller_take_dirty(uint8_t table, uint16_t *address);
 
-void modbus_controller_init(uint8_t address); // Sets address
+// Double banked regions, so master never reads values half way through an update. Meant for regions master only reads,
+// master writes that land between begin_update and the swap are lost
+void *modbus_controller_begin_update(modbus_controller_region *region);	// Returns shadow bank holding latest values, write it freely. Cancels a commit not yet swapped in
+void modbus_controller_commit(modbus_controller_region *region);			// Shadow becomes active before next frame is served, no locking needed around updates
 
-void modbus_controller_tick(void); // Call every tick, checks if Modbus message is available and processes it
+// For function handlers
+void modbus_controller_write(modbus_server_t *server);						// Appends CRC to write_buffer and transmits it
+void modbus_controller_exception(modbus_server_t *server, uint8_t exception);	// Turns write_buffer into an exception reply, still needs writing
 
 #endif
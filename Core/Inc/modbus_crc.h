@@ -0,0 +1,60 @@
+#ifndef MODBUS_CRC_H
+#define MODBUS_CRC_H
+
+#include <stdint.h>
+#include "stm32c0xx_hal.h"
+
+#define MODBUS_CRC_SOFTWARE 0	// MODBUS_CRC_ENGINE table walk
+#define MODBUS_CRC_HARDWARE 1	// CRC unit programmed for CRC-16/MODBUS: polynomial 0x8005, reflected in & out, init 0xFFFF
+
+#ifndef MODBUS_CRC_BACKEND
+#define MODBUS_CRC_BACKEND MODBUS_CRC_HARDWARE	// Behind modbus_crc() only. Interrupt handlers always use the software path so they never race the CRC unit
+#endif
+
+// Software engines, behind modbus_crc_software() and the per-byte MODBUS_CRC_UPDATE() interrupt handlers use
+#define MODBUS_CRC_NIBBLE 		0	// 32 byte table, two lookups per byte
+#define MODBUS_CRC_BYTE 		1	// 512 byte table, one lookup per byte
+#define MODBUS_CRC_SLICE_BY_4 	2	// 2K of tables, four bytes per step. Per-byte updates still take the byte table
+
+#ifndef MODBUS_CRC_ENGINE
+#define MODBUS_CRC_ENGINE MODBUS_CRC_BYTE
+#endif
+
+#ifndef MODBUS_CRC_DMA
+#define MODBUS_CRC_DMA 0	// 1 feeds CRC unit through memory-to-memory DMA instead of CPU words. Completion is polled. Only with MODBUS_CRC_HARDWARE
+#endif
+
+#if MODBUS_CRC_DMA
+#if MODBUS_CRC_BACKEND != MODBUS_CRC_HARDWARE
+#error "MODBUS_CRC_DMA needs MODBUS_CRC_HARDWARE"
+#endif
+
+// Channel 3 by default, modbus_io defaults take 1 & 2
+#ifndef MODBUS_CRC_DMA_CHANNEL
+#define MODBUS_CRC_DMA_CHANNEL 			DMA1_Channel3
+#define MODBUS_CRC_DMA_DMAMUX_CHANNEL 	DMAMUX1_Channel2
+#define MODBUS_CRC_DMA_TC_FLAG 			DMA_ISR_TCIF3
+#define MODBUS_CRC_DMA_CLEAR_FLAGS 		DMA_IFCR_CGIF3
+#endif
+#endif
+
+#if MODBUS_CRC_ENGINE == MODBUS_CRC_NIBBLE
+extern const uint16_t modbus_crc_nibble_table[16];
+
+#define MODBUS_CRC_UPDATE_NIBBLE(crc, nibble) 	(((crc) >> 4) ^ modbus_crc_nibble_table[((crc) ^ (nibble)) & 0x0F])
+#define MODBUS_CRC_UPDATE(crc, byte) 			MODBUS_CRC_UPDATE_NIBBLE(MODBUS_CRC_UPDATE_NIBBLE((crc), (byte)), (byte) >> 4)	// Folds one byte into a running CRC
+#else
+extern const uint16_t modbus_crc_table[256];	// The one copy, shared by every user of the software path
+
+#define MODBUS_CRC_UPDATE(crc, byte) 			(((crc) >> 8) ^ modbus_crc_table[((crc) ^ (byte)) & 0xFF])	// Folds one byte into a running CRC
+#endif
+
+#if MODBUS_CRC_ENGINE == MODBUS_CRC_SLICE_BY_4
+extern const uint16_t modbus_crc_slice_tables[3][256];	// Built at compile time from the polynomial
+#endif
+
+void modbus_crc_init(void);											// Clocks & programs CRC unit with MODBUS_CRC_HARDWARE, nothing otherwise
+uint16_t modbus_crc(const uint8_t *data, uint16_t length);			// CRC over data through MODBUS_CRC_BACKEND. Application context only
+uint16_t modbus_crc_software(const uint8_t *data, uint16_t length);	// MODBUS_CRC_ENGINE, safe from interrupt handlers
+
+#endif
@@ -2,28 +2,225 @@
 #define MODBUS_IO_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "stm32c0xx_hal.h"
 
 #define MODBUS_IO_BUFFER_SIZE 256
 
-// Enables UART RXNE interrupt and disables UART TXE. Prescales timer to match baud rate, sets it to one pulse mode and configures CC1 & CC2 to character wait times
+#ifndef MODBUS_IO_QUEUE_DEPTH
+#define MODBUS_IO_QUEUE_DEPTH 2	// Received frames that can wait for the application, costs MODBUS_IO_BUFFER_SIZE each on top of receive buffer. Max 254
+#endif
+
+#ifndef MODBUS_IO_SPEC_TIMEOUTS
+#define MODBUS_IO_SPEC_TIMEOUTS 1	// Fixed 750 us 1.5 & 1750 us 3.5 character times above 19200 baud, as spec requires. 0 scales them with baud rate instead
+#endif
+
+#ifndef MODBUS_IO_MUTE_FOREIGN_FRAMES
+#define MODBUS_IO_MUTE_FOREIGN_FRAMES 0	// Puts USART in mute mode until line goes idle once a frame is for another unit ID. Saves an interrupt per byte, but a 1-1.5 character gap inside a frame wakes it early
+// Muted bytes don't reach RXNE, so RX_TIMER hands end of a muted frame to the receiver timeout instead of TIM2
+#endif
+
+#ifndef MODBUS_IO_RX_CRC
+#define MODBUS_IO_RX_CRC 1	// Folds every received byte into a running CRC, so frame is already checked when it's queued. 0 leaves CRC to the application
+// RX_DMA is the exception: no CPU sees bytes arrive and receiver timeout interrupt stays short, so modbus_io_crc_valid() makes one modbus_crc() pass in application context
+#endif
+
+#ifndef MODBUS_IO_PENDSV
+#define MODBUS_IO_PENDSV 0	// Pends PendSV along with ready flag, so application can be ticked from PendSV_Handler below port interrupts instead of main loop
+#endif
+
+// Receive engines
+#define MODBUS_IO_RX_TIMER	0	// RXNE interrupt per byte, TIM2 CC1 & CC2 detect 1.5 & 3.5 character times
+#define MODBUS_IO_RX_DMA	1	// DMA streams bytes into receive buffer, USART receiver timeout detects 3.5 character times
+#define MODBUS_IO_RX_FIFO	2	// RXFIFO threshold interrupt drains bytes in bursts, USART receiver timeout detects 3.5 character times
+
+#ifndef MODBUS_IO_RX_MODE
+#define MODBUS_IO_RX_MODE MODBUS_IO_RX_TIMER
+#endif
+
+#ifndef MODBUS_IO_SPECULATIVE
+#define MODBUS_IO_SPECULATIVE 0	// Queues frame tentatively at 1.5 character time so reply can be built before 3.5. Withdrawn if line wakes in between. Only with MODBUS_IO_RX_TIMER
+#endif
+
+#if MODBUS_IO_SPECULATIVE && (MODBUS_IO_RX_MODE != MODBUS_IO_RX_TIMER)
+#error "MODBUS_IO_SPECULATIVE needs the 1.5 character time only MODBUS_IO_RX_TIMER measures"
+#endif
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+// Defaults for a port that isn't given its own channels with modbus_io_dma()
+#define MODBUS_IO_RX_DMA_CHANNEL 	DMA1_Channel1	// Must not be claimed by anything else
+#define MODBUS_IO_RX_DMAMUX_CHANNEL DMAMUX1_Channel0	// DMAMUX channel n feeds DMA channel n + 1
+#define MODBUS_IO_RX_DMA_REQUEST	DMA_REQUEST_USART1_RX
+#endif
+
+// Transmit engines
+#define MODBUS_IO_TX_TC		0	// Data is copied into transmit buffer, TC interrupt per byte
+#define MODBUS_IO_TX_DMA	1	// Caller's buffer is drained in place by DMA, single TC interrupt at the end
+#define MODBUS_IO_TX_FIFO	2	// Data is copied into transmit buffer, TXFIFO threshold interrupt refills FIFO in bursts
+
+#ifndef MODBUS_IO_TX_MODE
+#define MODBUS_IO_TX_MODE MODBUS_IO_TX_TC
+#endif
+
+#if MODBUS_IO_TX_MODE == MODBUS_IO_TX_DMA
+#define MODBUS_IO_TX_DMA_CHANNEL 	DMA1_Channel2
+#define MODBUS_IO_TX_DMAMUX_CHANNEL DMAMUX1_Channel1
+#define MODBUS_IO_TX_DMA_REQUEST	DMA_REQUEST_USART1_TX
+#endif
+
+// FIFO is 8 bytes deep, RX interrupts once 6 are waiting and TX once only 2 are left to send
+#define MODBUS_IO_RX_FIFO_THRESHOLD	UART_RXFIFO_THRESHOLD_3_4
+#define MODBUS_IO_TX_FIFO_THRESHOLD	UART_TXFIFO_THRESHOLD_1_4
+
+typedef struct {
+	uint32_t last, min, max;	// Bit times from request's 3.5 character time to reply's first start bit
+	uint32_t late;				// Replies dropped for missing maximum reply delay
+} modbus_io_turnaround_stats;
+
+typedef struct {
+	uint32_t bus_messages;			// Frames seen on the bus, whatever unit ID they're for
+	uint32_t line_errors;			// Frames discarded for a parity, framing, noise or overrun error on any of their bytes
+	uint32_t character_overruns;	// Overrun errors, a character arrived before the previous one was read
+} modbus_io_line_stats;
+
+// Single producer (ISR), single consumer (application) ring of frame descriptors. ISR fills frame at head and only advances head,
+// application borrows frame at tail and only advances tail, so neither side has to disable interrupts. One slot is always being received into
+// Slots from tail up to head belong to application, the rest to ISR. Each index is written by its owner only, after a barrier:
+// ISR fills slot, DMB, advances head (release). Application reads head, DMB, reads slot (acquire). Application is done with slot, DMB, advances tail
+// Only exception is a withdrawn tentative frame, whose size ISR zeroes after publishing it
+typedef struct {
+	volatile uint16_t size;
+	volatile bool crc_valid;
+	volatile uint8_t data[MODBUS_IO_BUFFER_SIZE];
+} modbus_io_frame;
+
+// One per Modbus port. Fields are private to modbus_io, instance must start zeroed (static storage does)
+typedef struct {
+	volatile UART_HandleTypeDef* huart;
+	volatile TIM_HandleTypeDef*  htim;
+	uint32_t counter_max;	// 16 or 32 bit timer, times & reply window must fit
+
+	volatile bool frame_new, frame_end;
+
+	// Reply may only start once minimum reply delay has passed since request's 3.5 character time, and is dropped once maximum has passed
+	volatile bool reply_window_open, reply_window_closed;
+	uint32_t de_assertion_bits;
+	volatile modbus_io_turnaround_stats turnarounds;
+
+	volatile uint16_t transmit_size;
+	volatile bool transmit_started;
+#if MODBUS_IO_TX_MODE == MODBUS_IO_TX_DMA
+	volatile uint8_t* transmit_data;	// Borrowed from caller until transmission completes
+#else
+	volatile uint16_t transmit_head;
+	volatile uint8_t transmit_buffer[MODBUS_IO_BUFFER_SIZE];
+#endif
+
+	modbus_io_frame frames[MODBUS_IO_QUEUE_DEPTH + 1];
+	volatile uint8_t frames_head, frames_tail;
+	volatile uint32_t frames_overflows;
+	volatile bool ready;	// Something application may be waiting on has happened
+
+	// Frame queued at 1.5 character time, until 3.5 confirms it. Withdrawn frames are left in queue with size 0 for application to skip
+	volatile uint8_t tentative_frame;
+	volatile bool reply_tentative;	// Pending transmit answers tentative frame
+
+	volatile uint16_t receive_size;
+	volatile uint8_t* volatile receive_buffer;
+#if MODBUS_IO_RX_CRC
+	volatile uint16_t receive_crc;	// Running CRC over every stored byte, CRC included. Comes out 0 for an intact frame
+#endif
+
+	// Bit per unit ID frames are accepted for, broadcast is always accepted. Empty set accepts every frame
+	uint8_t addresses[32];
+	bool address_filter;
+	volatile bool frame_foreign;	// Rest of current frame is discarded as it arrives, or only kept to confirm auto-baud
+	volatile bool frame_poisoned;	// Line error hit current frame, rest of it is discarded and it's never queued
+	volatile modbus_io_line_stats lines;
+
+	uint32_t huart_kernel_freq, tim_kernel_freq;	// After prescalers
+	uint16_t min_reply_bits, max_reply_bits;
+
+	// Format switch requested by application, applied by ISR at next frame boundary with nothing left to transmit. Baud rate 0 starts auto-baud
+	volatile bool format_pending, auto_baud_pending;
+	uint32_t pending_baud, pending_parity, pending_stop_bits;
+	volatile bool auto_baud_measured;	// Rate measured on current frame, waiting for frame end to confirm it
+	uint32_t auto_baud_fallback;		// BRR to go back to if it isn't
+
+	DMA_Channel_TypeDef *rx_dma_channel, *tx_dma_channel;
+	DMAMUX_Channel_TypeDef *rx_dmamux_channel, *tx_dmamux_channel;
+	uint32_t rx_dma_request, tx_dma_request;
+} modbus_io_t;
+
+// Gives port its own DMA channels, call before modbus_io_init(). Channels must not be shared with another port
+void modbus_io_dma(
+	modbus_io_t *io,
+	DMA_Channel_TypeDef *rx_channel, DMAMUX_Channel_TypeDef *rx_dmamux_channel, uint32_t rx_request,
+	DMA_Channel_TypeDef *tx_channel, DMAMUX_Channel_TypeDef *tx_dmamux_channel, uint32_t tx_request
+);
+
+// Enables UART RXNE interrupt (or RX DMA and receiver timeout interrupt) and disables UART TXE. Prescales timer to match baud rate, sets it to one pulse mode and configures CC1 & CC2 to character wait times, CC3 & CC4 to reply window
+// Any timer with 4 capture/compare channels will do. A 16 bit one caps 3.5 character time plus maximum reply delay at 65535 bits
 void modbus_io_init(
+	modbus_io_t *io,
 	UART_HandleTypeDef* _modbus_io_huart, uint32_t modbus_io_huart_freq, 	// UART kernel clock frequency, without prescaler
-	TIM_HandleTypeDef* _modbus_io_htim, uint32_t modbus_io_tim_freq		 	// Timer clock frequency
+	TIM_HandleTypeDef* _modbus_io_htim, uint32_t modbus_io_tim_freq,		// Timer clock frequency
+	uint8_t de_assertion_bits, uint8_t de_deassertion_bits,					// RS-485 driver enable lead/lag around transmitted frames, hardware caps these just under 2 bits (or 4 with 8x oversampling)
+	uint16_t min_reply_bits, uint16_t max_reply_bits						// Reply window after request's 3.5 character time, 0 for unbounded. Replies missing the window are dropped
 );
 
+void modbus_io_filter_address(modbus_io_t *io, uint8_t address);	// Adds unit ID to those whose frames are received. Broadcast is always received. Until called, every frame is received
+
 // Make sure buffers are at most/least size MODBUS_IO_BUFFER_SIZE!
-uint16_t modbus_io_write(uint8_t *data, uint16_t len);	// Returns number of bytes that'll be transmitted
+uint16_t modbus_io_write(modbus_io_t *io, uint8_t *data, uint16_t len);	// Returns number of bytes that'll be transmitted. With MODBUS_IO_TX_DMA, data is owned by modbus_io until modbus_io_write_busy() is false
 
-uint16_t modbus_io_read(uint8_t *buffer);				// Returns number of bytes that are read into buffer
+bool modbus_io_write_busy(modbus_io_t *io);						// True while a previous write is still being transmitted
+
+uint16_t modbus_io_read(modbus_io_t *io, uint8_t *buffer);		// Returns number of bytes that are read into buffer. Copies, prefer borrowing
+
+uint16_t modbus_io_borrow(modbus_io_t *io, uint8_t **frame);	// Points frame at oldest queued frame without copying and returns its size, 0 if none. Frame stays valid until returned
+void modbus_io_return(modbus_io_t *io, uint8_t *frame);			// Hands borrowed frame back and dequeues it
+bool modbus_io_tentative(modbus_io_t *io);						// True while oldest queued frame may still be withdrawn. Its reply is held until 3.5 character time, and dropped if frame is withdrawn
+bool modbus_io_crc_valid(modbus_io_t *io);						// True if oldest queued frame ended in a correct CRC. Only with MODBUS_IO_RX_CRC, application context (runs modbus_crc() with RX_DMA)
+
+bool modbus_io_ready(modbus_io_t *io);							// Takes flag set whenever a frame is queued or confirmed, or a transmission ends. Tick application again if set, otherwise it can sleep
+uint8_t modbus_io_queue_depth(modbus_io_t *io);					// Number of received frames waiting, including a borrowed one
+uint32_t modbus_io_queue_overflows(modbus_io_t *io);			// Number of frames dropped because queue was full
+
+void modbus_io_turnaround(modbus_io_t *io, modbus_io_turnaround_stats *stats);	// Copies out turnaround measurements
+
+void modbus_io_line(modbus_io_t *io, modbus_io_line_stats *stats);	// Copies out receive line counters. They only ever count up, take differences to reset
+
+// Switches format at next frame boundary with nothing left to transmit, so queue any reply still due at old format first. Parity & stop bits take UART_PARITY_x & UART_STOPBITS_x
+void modbus_io_reconfigure(modbus_io_t *io, uint32_t baud_rate, uint32_t parity, uint32_t stop_bits);
+
+// Starts measuring baud rate at the boundary modbus_io_reconfigure() would switch at, parity & stop bits stay. Rate comes from start bit of following frame's first byte,
+// kept once it's a standard rate and that frame arrives intact, otherwise old rate is restored and next frame is measured
+// Only a first byte with its LSB set (odd unit ID) measures right. With an even unit ID, rate locks on frames for odd ones, which are checked whoever they're for
+void modbus_io_auto_baud(modbus_io_t *io);
+
+// Call from port's USARTx_IRQHandler() & TIMx_IRQHandler(), they dispatch to handlers below
+void modbus_io_usart_irq_handler(modbus_io_t *io);
+
+void modbus_io_tim_irq_handler(modbus_io_t *io);
 
 // Handlers clear any requisite flags
-void modbus_io_tc_handler(void);
+void modbus_io_tc_handler(modbus_io_t *io);
+
+void modbus_io_rx_ne_handler(modbus_io_t *io);
+
+void modbus_io_1_5_char_handler(modbus_io_t *io);
+
+void modbus_io_3_5_char_handler(modbus_io_t *io);
+
+void modbus_io_min_reply_handler(modbus_io_t *io);	// Timer CC3
+
+void modbus_io_max_reply_handler(modbus_io_t *io);	// Timer CC4
 
-void modbus_io_rx_ne_handler(void);
+void modbus_io_rto_handler(modbus_io_t *io);	// Receiver timeout, only used by MODBUS_IO_RX_DMA & MODBUS_IO_RX_FIFO
 
-void modbus_io_1_5_char_handler(void);
+void modbus_io_rx_ft_handler(modbus_io_t *io);	// RXFIFO threshold, only used by MODBUS_IO_RX_FIFO
 
-void modbus_io_3_5_char_handler(void);
+void modbus_io_tx_ft_handler(modbus_io_t *io);	// TXFIFO threshold, only used by MODBUS_IO_TX_FIFO
 
 #endif
@@ -48,7 +48,8 @@ UART_HandleTypeDef huart1;
 UART_HandleTypeDef huart2;
 
 /* USER CODE BEGIN PV */
-
+modbus_io_t modbus_io_1;	// USART1 & TIM2. More ports each need their own USART & 4 channel timer, plus IRQ dispatch in stm32c0xx_it.c
+modbus_server_t modbus_server_1;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -100,8 +101,11 @@ int main(void)
   MX_TIM2_Init();
   /* USER CODE BEGIN 2 */
   debug_init(&huart2);
-  modbus_io_init(&huart1, HAL_RCC_GetPCLK1Freq(), &htim2, HAL_RCC_GetPCLK1Freq());
-  modbus_controller_init(0x42);
+  modbus_io_init(&modbus_io_1, &huart1, HAL_RCC_GetPCLK1Freq(), &htim2, HAL_RCC_GetPCLK1Freq(), 0, 0, 0, 0);
+  modbus_controller_init(&modbus_server_1, &modbus_io_1, 0x42);
+#if MODBUS_IO_PENDSV
+  HAL_NVIC_SetPriority(PendSV_IRQn, 3, 0);	// Below port interrupts, which must stay above it
+#endif
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -111,7 +115,18 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
-	  modbus_controller_tick();
+#if MODBUS_IO_PENDSV
+	  __WFI();	// Modbus is served from PendSV_Handler, application work goes here
+#else
+	  while(modbus_controller_tick(&modbus_server_1));	// Drain queue, a burst of frames may have piled up while one was served
+
+	  // Sleep until an interrupt has something for the tick. Interrupts are masked so a frame landing between check and WFI still wakes it,
+	  // its handler then runs once they're unmasked. Stop mode would halt the timer pacing the port
+	  __disable_irq();
+	  if(!modbus_io_ready(&modbus_io_1))
+		  __WFI();
+	  __enable_irq();
+#endif
   }
   /* USER CODE END 3 */
 }
@@ -1,495 +1,1033 @@
 #include "modbus_controller.h"
 #include "modbus_io.h"
+#include "modbus_crc.h"
 #include "debug.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 
-static uint8_t m_c_address;
+#define MODBUS_CONTROLLER_NO_REGION 0xFF
+
+typedef struct {
+	modbus_controller_region *regions;
+	uint8_t count;
+	uint8_t pages[MODBUS_CONTROLLER_PAGES];	// First region reaching into each page
+} modbus_controller_region_map;
+
+static modbus_controller_region_map m_c_maps[MODBUS_CONTROLLER_TABLES];
+static volatile bool m_c_commits_pending;	// Any region's commit_pending
+
+#if MODBUS_CONTROLLER_COILS_BYTE_SIZE
+static uint32_t m_c_coils[(MODBUS_CONTROLLER_COILS_BYTE_SIZE + 3) >> 2];		// Word-wide for bitfield_insert, little-endian so byte view matches bit order
+#endif
+#if MODBUS_CONTROLLER_DISCRETE_INPUTS_BYTE_SIZE
+static uint32_t m_c_discrete_inputs[(MODBUS_CONTROLLER_DISCRETE_INPUTS_BYTE_SIZE + 3) >> 2];
+#endif
+#if MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE
+static uint16_t m_c_holding_registers[MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE] __ALIGNED(4);	// Word aligned for copy_be16_from_host/copy_host_from_be16
+#endif
+#if MODBUS_CONTROLLER_INPUT_REGISTERS_SIZE
+static uint16_t m_c_input_registers[MODBUS_CONTROLLER_INPUT_REGISTERS_SIZE] __ALIGNED(4);
+#endif
+
+static modbus_controller_region m_c_default_regions[MODBUS_CONTROLLER_TABLES] = {
+#if MODBUS_CONTROLLER_COILS_BYTE_SIZE
+	[MODBUS_CONTROLLER_COILS] 				= {0, MODBUS_CONTROLLER_COILS_BYTE_SIZE << 3, 			m_c_coils, 				MODBUS_CONTROLLER_REGION_READ | MODBUS_CONTROLLER_REGION_WRITE},
+#endif
+#if MODBUS_CONTROLLER_DISCRETE_INPUTS_BYTE_SIZE
+	[MODBUS_CONTROLLER_DISCRETE_INPUTS] 	= {0, MODBUS_CONTROLLER_DISCRETE_INPUTS_BYTE_SIZE << 3, m_c_discrete_inputs, 	MODBUS_CONTROLLER_REGION_READ},
+#endif
+#if MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE
+	[MODBUS_CONTROLLER_HOLDING_REGISTERS] 	= {0, MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE, 		m_c_holding_registers, 	MODBUS_CONTROLLER_REGION_READ | MODBUS_CONTROLLER_REGION_WRITE},
+#endif
+#if MODBUS_CONTROLLER_INPUT_REGISTERS_SIZE
+	[MODBUS_CONTROLLER_INPUT_REGISTERS] 	= {0, MODBUS_CONTROLLER_INPUT_REGISTERS_SIZE, 			m_c_input_registers, 	MODBUS_CONTROLLER_REGION_READ},
+#endif
+};
+
+void modbus_controller_init(modbus_server_t *server, modbus_io_t *io, uint8_t address) {
+	server->io = io;
+	server->address = address;
+
+	modbus_io_filter_address(io, address);
+
+	modbus_crc_init();
+
+	for(uint8_t table = 0; table < MODBUS_CONTROLLER_TABLES; ++table)	// Tables the application hasn't mapped yet
+		if(m_c_maps[table].regions == NULL)
+			modbus_controller_map(table, &m_c_default_regions[table], (m_c_default_regions[table].length > 0) ? 1 : 0);
+}
+
+bool modbus_controller_map(uint8_t table, modbus_controller_region *regions, uint8_t count) {
+	if((table >= MODBUS_CONTROLLER_TABLES) || (count >= MODBUS_CONTROLLER_NO_REGION))
+		return false;
+
+	for(uint8_t i = 0; i < count; ++i)
+		if(
+			(regions[i].length == 0) ||
+			(((uint32_t)regions[i].base + regions[i].length) > 0x10000) ||
+			((i > 0) && (regions[i].base < ((uint32_t)regions[i - 1].base + regions[i - 1].length)))	// Unsorted or overlapping
+		)
+			return false;
+
+	modbus_controller_region_map *map = &m_c_maps[table];
+	uint8_t region = 0;
 
-static uint16_t m_c_read_buffer_size;
-static uint8_t m_c_read_buffer[MODBUS_IO_BUFFER_SIZE];
+	for(uint32_t page = 0; page < MODBUS_CONTROLLER_PAGES; ++page) {
+		uint32_t start = page << MODBUS_CONTROLLER_PAGE_SHIFT;
 
-static uint16_t m_c_write_buffer_size;
-static uint8_t m_c_write_buffer[MODBUS_IO_BUFFER_SIZE];
+		while((region < count) && (((uint32_t)regions[region].base + regions[region].length) <= start))	// Ended before this page
+			++region;
 
-static uint8_t m_c_coils[MODBUS_CONTROLLER_COILS_BYTE_SIZE];
-static uint8_t m_c_discrete_inputs[MODBUS_CONTROLLER_DISCRETE_INPUTS_BYTE_SIZE];
-static uint16_t m_c_holding_registers[MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE];
-static uint16_t m_c_input_registers[MODBUS_CONTROLLER_INPUT_REGISTERS_SIZE];
+		map->pages[page] = ((region < count) && (regions[region].base < (start + (1UL << MODBUS_CONTROLLER_PAGE_SHIFT)))) ? region : MODBUS_CONTROLLER_NO_REGION;
+	}
+
+	map->regions = regions;
+	map->count = count;
 
-void modbus_controller_init(uint8_t address) {
-	m_c_address = address;
+	return true;
 }
 
-void process_modbus_message(void);
+modbus_controller_region *find_region(uint8_t table, uint16_t address) {	// Region holding address, NULL if unmapped
+	modbus_controller_region_map *map = &m_c_maps[table];
+	uint8_t i = map->pages[address >> MODBUS_CONTROLLER_PAGE_SHIFT];
 
-uint16_t calculate_CRC(uint8_t *data, uint16_t length);
+	if(i == MODBUS_CONTROLLER_NO_REGION)
+		return NULL;
 
-// char echo[2048];
-void modbus_controller_tick(void) {
-	m_c_read_buffer_size = modbus_io_read(m_c_read_buffer);
+	while((i < map->count) && (address >= ((uint32_t)map->regions[i].base + map->regions[i].length)))	// Only regions sharing the page
+		++i;
 
-	if(m_c_read_buffer_size < MODBUS_MIN_MESSAGE_BYTES)
-		return;
+	return ((i < map->count) && (address >= map->regions[i].base)) ? &map->regions[i] : NULL;
+}
 
-	// for (uint16_t i = 0; i < m_c_read_buffer_size; ++i)
-	// 	sprintf(&echo[i * 3], "%02X ", m_c_read_buffer[i]);
+bool span_mapped(uint8_t table, uint16_t address, uint16_t quantity, uint8_t flags) {	// Every address from address on is in a region allowing flags
+	uint32_t end = (uint32_t)address + quantity;
+	if(end > 0x10000)	// Runs past the last address
+		return false;
 
-	// echo[m_c_read_buffer_size * 3] = '\r';
-	// echo[m_c_read_buffer_size * 3 + 1] = '\n';
-	// echo[m_c_read_buffer_size * 3 + 2] = '\0';
+	for(uint32_t next = address; next < end; ) {	// Stays below 0x10000, so find_region never sees a wrapped address
+		modbus_controller_region *region = find_region(table, next);
 
-	// debug_write((uint8_t*)echo, strlen(echo));
+		if((region == NULL) || ((region->flags & flags) != flags))
+			return false;
 
-	if(m_c_read_buffer[MODBUS_ADDRESS_INDEX] != m_c_address)
-		return;
+		next = (uint32_t)region->base + region->length;	// Following region has to start right there
+	}
 
-	uint16_t crc = (m_c_read_buffer[m_c_read_buffer_size - MODBUS_CRC_BYTES + 1] << 8) |
-			   	   (m_c_read_buffer[m_c_read_buffer_size - MODBUS_CRC_BYTES]);
+	return true;
+}
 
-	if(crc != calculate_CRC(m_c_read_buffer, m_c_read_buffer_size - MODBUS_CRC_BYTES))
-		return;
+bool modbus_controller_take_dirty(uint8_t table, uint16_t *address) {
+	if(table >= MODBUS_CONTROLLER_TABLES)
+		return false;
+
+	modbus_controller_region_map *map = &m_c_maps[table];
+
+	for(uint8_t i = 0; i < map->count; ++i) {
+		modbus_controller_region *region = &map->regions[i];
+
+		if((region->dirty == NULL) || ((region->base + (uint32_t)region->length) <= *address))
+			continue;
+
+		uint16_t offset = (*address > region->base) ? (*address - region->base) : 0;
+
+		for(uint16_t word = offset >> 5; word < ((region->length + 31) >> 5); ++word) {
+			uint32_t bits = region->dirty[word];
+			if(word == (offset >> 5))
+				bits &= 0xFFFFFFFFUL << (offset & 0x1F);
+
+			if(bits == 0)
+				continue;
+
+			uint8_t bit = __builtin_ctz(bits);
+
+			uint32_t primask = __get_PRIMASK();	// Handlers may set other bits of word in between
+			__disable_irq();
+			region->dirty[word] &= ~(1UL << bit);
+			__set_PRIMASK(primask);
+
+			*address = region->base + (word << 5) + bit;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint16_t bank_bytes(modbus_controller_region *region) {
+	for(uint8_t table = 0; table < MODBUS_CONTROLLER_TABLES; ++table)
+		if((region >= m_c_maps[table].regions) && (region < (m_c_maps[table].regions + m_c_maps[table].count)))
+			return ((table == MODBUS_CONTROLLER_COILS) || (table == MODBUS_CONTROLLER_DISCRETE_INPUTS)) ? ((region->length + 31) >> 5) << 2 : region->length << 1;
 
-	process_modbus_message();
+	return 0;
 }
 
-void modbus_controller_write(void) {	// Appends CRC before transmitting
-	uint16_t crc = calculate_CRC(m_c_write_buffer, m_c_write_buffer_size);
+void *modbus_controller_begin_update(modbus_controller_region *region) {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	bool pending = region->commit_pending;	// Shadow already holds latest values then
+	region->commit_pending = false;
+	__set_PRIMASK(primask);
 
-	m_c_write_buffer[m_c_write_buffer_size++] = crc & 0xFF;
-	m_c_write_buffer[m_c_write_buffer_size++] = crc >> 8;
+	if(!pending)
+		memcpy(region->shadow, region->storage, bank_bytes(region));
 
-	modbus_io_write(m_c_write_buffer, m_c_write_buffer_size);
+	return region->shadow;
 }
 
-void modbus_controller_exception(uint8_t exception) {	// Sets MSB of function code, appends exception code as data
-	m_c_write_buffer[MODBUS_FUNCTION_INDEX] |= 0x80;
+void modbus_controller_commit(modbus_controller_region *region) {
+	region->commit_pending = true;
+	m_c_commits_pending = true;
+}
+
+void process_modbus_message(modbus_server_t *server);
+
+bool validate_modbus_message(modbus_server_t *server);
+
+const modbus_controller_function *find_function(uint8_t function);
 
-	m_c_write_buffer[MODBUS_EXCEPTION_INDEX] = exception;
+bool speculation_safe(modbus_server_t *server) {	// Only functions without side effects may run on a frame that could still be withdrawn
+	if(server->read_buffer_size <= MODBUS_FUNCTION_INDEX)
+		return true;
 
-	m_c_write_buffer_size = MODBUS_MIN_MESSAGE_BYTES - MODBUS_CRC_BYTES + 1;
+	const modbus_controller_function *function = find_function(server->read_buffer[MODBUS_FUNCTION_INDEX]);
+
+	return (function == NULL) || function->speculative;	// Unserved codes only get an exception back
+}
+
+void swap_banks(void) {	// Between frames, so a reply is built from one bank
+	m_c_commits_pending = false;
+
+	for(uint8_t table = 0; table < MODBUS_CONTROLLER_TABLES; ++table)
+		for(uint8_t i = 0; i < m_c_maps[table].count; ++i) {
+			modbus_controller_region *region = &m_c_maps[table].regions[i];
+
+			uint32_t primask = __get_PRIMASK();	// Commit may come from an interrupt above this one
+			__disable_irq();
+			if(region->commit_pending) {
+				void *active = region->storage;
+				region->storage = region->shadow;
+				region->shadow = active;
+				region->commit_pending = false;
+			}
+			__set_PRIMASK(primask);
+		}
 }
 
-uint16_t calculate_CRC(uint8_t *data, uint16_t length) {
-    uint8_t temp;
-    uint16_t crc = 0xFFFF;  						// Initialize CRC register
+bool modbus_controller_tick(modbus_server_t *server) {
+	if(m_c_commits_pending)
+		swap_banks();
+
+	if(modbus_io_write_busy(server->io))	// Reply may still be transmitting straight out of server->write_buffer
+		return false;
+
+	server->read_buffer_size = modbus_io_borrow(server->io, &server->read_buffer);
+
+	if(server->read_buffer_size == 0)
+		return false;
+
+	if(modbus_io_tentative(server->io) && !speculation_safe(server))	// Left queued until 3.5 character time confirms frame
+		return false;
+
+	if(validate_modbus_message(server))
+		process_modbus_message(server);
+
+	modbus_io_return(server->io, server->read_buffer);
+
+	return true;
+}
+
+// char echo[2048];
+bool validate_modbus_message(modbus_server_t *server) {	// Checks length, address and CRC of server->read_buffer
+	if(server->read_buffer_size < MODBUS_MIN_MESSAGE_BYTES)
+		return false;
+
+	// for (uint16_t i = 0; i < server->read_buffer_size; ++i)
+	// 	sprintf(&echo[i * 3], "%02X ", server->read_buffer[i]);
+
+	// echo[server->read_buffer_size * 3] = '\r';
+	// echo[server->read_buffer_size * 3 + 1] = '\n';
+	// echo[server->read_buffer_size * 3 + 2] = '\0';
+
+	// debug_write((uint8_t*)echo, strlen(echo));
+
+	uint8_t address = server->read_buffer[MODBUS_ADDRESS_INDEX];
+
+	if((address != server->address) && (address != 0))
+		return false;
+
+#if MODBUS_IO_RX_CRC
+	bool crc_valid = modbus_io_crc_valid(server->io);	// Checked byte by byte as frame arrived. With RX_DMA it makes the one whole frame pass instead
+#else
+	uint16_t crc = (server->read_buffer[server->read_buffer_size - MODBUS_CRC_BYTES + 1] << 8) |
+			   	   (server->read_buffer[server->read_buffer_size - MODBUS_CRC_BYTES]);
+
+	bool crc_valid = crc == modbus_crc(server->read_buffer, server->read_buffer_size - MODBUS_CRC_BYTES);
+#endif
+
+	if(!crc_valid) {
+		++server->crc_errors;
+		return false;
+	}
+
+	++server->server_messages;
 
-    for (uint16_t i = 0; i < length; ++i)
-	{
-    	temp = data[i] ^ crc;  						// XOR byte with low byte of CRC
-		crc >>= 8;                                  // Shift CRC right 8 bits
-		crc ^= crc_table[temp];                     // XOR with table lookup
+	if(address == 0) {	// Broadcasts aren't acted on, so never get a reply either
+		++server->no_responses;
+		return false;
 	}
 
-    return crc;
+	return true;
 }
 
-void process_read_coils(void);
-void process_read_discrete_inputs(void);
-void process_read_holding_registers(void);
-void process_read_input_registers(void);
-void process_write_single_coil(void);
-void process_write_single_register(void);
-void process_write_multiple_coils(void);
-void process_write_multiple_registers(void);
+void modbus_controller_write(modbus_server_t *server) {	// Appends CRC before transmitting
+	uint16_t crc = modbus_crc(server->write_buffer, server->write_buffer_size);
 
-void process_modbus_message(void) {	// Appends device address and function to m_c_write_buffer, then processes function
-	m_c_write_buffer[MODBUS_ADDRESS_INDEX] = m_c_read_buffer[MODBUS_ADDRESS_INDEX];
-	m_c_write_buffer[MODBUS_FUNCTION_INDEX] = m_c_read_buffer[MODBUS_FUNCTION_INDEX];
+	server->write_buffer[server->write_buffer_size++] = crc & 0xFF;
+	server->write_buffer[server->write_buffer_size++] = crc >> 8;
 
-	m_c_write_buffer_size = MODBUS_MIN_MESSAGE_BYTES - MODBUS_CRC_BYTES;
+	modbus_io_write(server->io, server->write_buffer, server->write_buffer_size);
 
-	switch(m_c_write_buffer[MODBUS_FUNCTION_INDEX]) {
-		case MODBUS_READ_COILS:
-			process_read_coils();
-			break;
-		case MODBUS_READ_DISCRETE_INPUTS:
-			process_read_discrete_inputs();
-			break;
-		case MODBUS_READ_HOLDING_REGISTERS:
-			process_read_holding_registers();
-			break;
-		case MODBUS_READ_INPUT_REGISTERS:
-			process_read_input_registers();
-			break;
-		case MODBUS_WRITE_SINGLE_COIL:
-			process_write_single_coil();
-			break;
-		case MODBUS_WRITE_SINGLE_REGISTER:
-			process_write_single_register();
-			break;
-		case MODBUS_WRITE_MULTPLE_COILS:
-			process_write_multiple_coils();
-			break;
-		case MODBUS_WRITE_MULTIPLE_REGISTERS:
-			process_write_multiple_registers();
-			break;
-		default:
-			modbus_controller_exception(MODBUS_ILLEGAL_FUNCTION);
-			modbus_controller_write();
+	server->replied = true;
+
+	// Event counter skips exceptions and its own polls, so master can tell whether a command went through
+	if(!(server->write_buffer[MODBUS_FUNCTION_INDEX] & 0x80) && (server->write_buffer[MODBUS_FUNCTION_INDEX] != MODBUS_GET_COMM_EVENT_COUNTER))
+		++server->comm_events;
+}
+
+void modbus_controller_exception(modbus_server_t *server, uint8_t exception) {	// Sets MSB of function code, appends exception code as data
+	++server->exceptions;
+
+	server->write_buffer[MODBUS_FUNCTION_INDEX] |= 0x80;
+
+	server->write_buffer[MODBUS_EXCEPTION_INDEX] = exception;
+
+	server->write_buffer_size = MODBUS_MIN_MESSAGE_BYTES - MODBUS_CRC_BYTES + 1;
+}
+
+// Copies nbits bits from src, starting at src_bit, to dst starting at dst_bit. Bits are LSB first as Modbus packs them
+// Bits below dst_bit in its byte are kept, unused high bits of last byte are zeroed, so spans can be appended one after another
+// Bits are staged in a 32 bit word so every source byte is loaded once, instead of a test & branch per bit
+void bitfield_extract(uint8_t *dst, uint16_t dst_bit, const uint8_t *src, uint16_t src_bit, uint16_t nbits) {
+	uint16_t index = src_bit >> 3, last = (src_bit + nbits - 1) >> 3;		// Nothing past last source byte holding a wanted bit is read
+	uint8_t offset = dst_bit & 0x07;
+	uint16_t end = offset + nbits;
+
+	dst += dst_bit >> 3;
+
+	uint32_t bits = (dst[0] & ((1 << offset) - 1)) | ((uint32_t)(src[index++] >> (src_bit & 0x07)) << offset);
+	int8_t count = offset + 8 - (src_bit & 0x07);							// Valid bits staged
+
+	for(uint16_t i = 0; i < ((end + 7) >> 3); ++i) {
+		if((count < 8) && (index <= last)) {
+			bits |= (uint32_t)src[index++] << count;
+			count += 8;
+		}
+
+		dst[i] = bits;
+		bits >>= 8;
+		count -= 8;
 	}
+
+	if(end & 0x07)
+		dst[(end - 1) >> 3] &= (1 << (end & 0x07)) - 1;
 }
 
-// Function 0x01: Read Coils
-void process_read_coils(void) {
-	if((m_c_read_buffer_size - MODBUS_CRC_BYTES) < (MODBUS_QUANTITY_OF_COILS_INDEX + 2))	// +1 to include Lo portion of QoC, +1 for count up to and including index
-		return;
+// Little-endian read of 32 source bits from bit, never touching bytes past last
+uint32_t load_bits(const uint8_t *src, uint32_t bit, uint16_t last) {
+	uint16_t index = bit >> 3;
+	uint8_t shift = bit & 0x07;
+	uint32_t bits = 0;
 
-	uint16_t starting_address = (m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
-								(m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
+	for(uint8_t i = 0; (i < 4) && ((index + i) <= last); ++i)
+		bits |= (uint32_t)src[index + i] << (i << 3);
 
-	if(starting_address >= (MODBUS_CONTROLLER_COILS_BYTE_SIZE << 3)) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_ADDRESS);
-		modbus_controller_write();
-		return;
+	bits >>= shift;
+	if(shift && ((index + 4) <= last))
+		bits |= (uint32_t)src[index + 4] << (32 - shift);
+
+	return bits;
+}
+
+// Merge nbits packed source bits from src_bit into dst at dst_bit, one masked write per word. Flipped bits are ORed into changed (per word, may be NULL), returns non-zero if any bit flipped
+uint32_t bitfield_insert(uint32_t *dst, uint16_t dst_bit, const uint8_t *src, uint16_t src_bit, uint16_t nbits, uint32_t *changed) {
+	uint32_t end = dst_bit + nbits, flipped = 0;
+	uint16_t last = (src_bit + nbits - 1) >> 3;
+
+	for(uint32_t bit = dst_bit; bit < end; bit = (bit | 0x1F) + 1) {			// Unaligned head and tail words get partial masks
+		uint32_t base = bit & ~0x1FUL, mask = 0xFFFFFFFFUL << (bit & 0x1F);
+		if((end - base) < 32)
+			mask &= (1UL << (end - base)) - 1;
+
+		uint32_t old = dst[bit >> 5];
+		uint32_t merged = (old & ~mask) | ((load_bits(src, src_bit + (bit - dst_bit), last) << (bit & 0x1F)) & mask);
+		dst[bit >> 5] = merged;
+
+		if(changed != NULL)
+			changed[bit >> 5] |= old ^ merged;
+		flipped |= old ^ merged;
 	}
 
-	uint16_t quantity_of_coils = (m_c_read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX] << 8) |
-								 (m_c_read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX + 1]);
+	return flipped;
+}
 
-	if(
-		(((MODBUS_CONTROLLER_COILS_BYTE_SIZE << 3) - starting_address) < quantity_of_coils) ||
-		(quantity_of_coils > 0x7D0) ||														// Can only send back 2000 coils max
-		(quantity_of_coils == 0)
-	) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_VALUE);
-		modbus_controller_write();
-		return;
+typedef uint32_t word_alias __attribute__((__may_alias__));	// Lets register and wire buffers be walked a word at a time
+
+// Host registers to big-endian wire bytes, REV16 on whole words with bytes only at unaligned edges
+void copy_be16_from_host(uint8_t *dst, const uint16_t *src, uint16_t count) {
+	if(((uintptr_t)src & 0x02) && count) {									// Odd register first so src is word aligned
+		*dst++ = *src >> 8;
+		*dst++ = *src++ & 0xFF;
+		--count;
 	}
 
-	uint8_t byte_count = (quantity_of_coils + 7) >> 3;
+	const word_alias *in = (const word_alias*)src;
+	uint16_t words = count >> 1;
+	uint8_t head = (-(uintptr_t)dst) & 0x03;								// Bytes until dst is word aligned
+
+	if(words && head) {
+		uint32_t bits = __REV16(*in++);
+		for(uint8_t i = 0; i < head; ++i, bits >>= 8)
+			*dst++ = bits;
+
+		word_alias *out = (word_alias*)dst;
+		for(uint16_t i = 1; i < words; ++i) {								// Funnel each aligned load across two aligned stores
+			uint32_t next = __REV16(*in++);
+			*out++ = bits | (next << ((4 - head) << 3));
+			bits = next >> (head << 3);
+		}
+
+		dst = (uint8_t*)out;
+		for(uint8_t i = head; i < 4; ++i, bits >>= 8)
+			*dst++ = bits;
+	}
+	else if(words) {
+		word_alias *out = (word_alias*)dst;
+		for(uint16_t i = 0; i < words; ++i)
+			*out++ = __REV16(*in++);
+		dst = (uint8_t*)out;
+	}
 
-	m_c_write_buffer[MODBUS_READ_BYTE_COUNT_INDEX] = byte_count;
-	m_c_write_buffer_size = MODBUS_READ_BYTE_COUNT_INDEX + 1;
+	if(count & 0x01) {
+		src = (const uint16_t*)in;
+		*dst++ = *src >> 8;
+		*dst = *src & 0xFF;
+	}
+}
 
-	uint16_t coil_address = starting_address;
-	for(uint8_t i = 0; i < byte_count; ++i) {
-		uint8_t byte_value = 0;
+// Big-endian wire bytes to host registers, mirror of copy_be16_from_host. Never reads past the last source byte
+void copy_host_from_be16(uint16_t *dst, const uint8_t *src, uint16_t count) {
+	if(((uintptr_t)dst & 0x02) && count) {
+		*dst++ = (src[0] << 8) | src[1];
+		src += 2;
+		--count;
+	}
 
-		for(uint8_t bit = 0; bit < 8; ++bit) {
-			if(m_c_coils[coil_address >> 3] & (1 << (coil_address & 0x07)))	// Get lower 3 bits for bit position
-				byte_value |= (1 << bit);
+	word_alias *out = (word_alias*)dst;
+	uint16_t words = count >> 1;
+	uint8_t head = (-(uintptr_t)src) & 0x03;
 
-			++coil_address;
+	if(words && head) {
+		uint32_t bits = 0;
+		for(uint8_t i = 0; i < head; ++i)
+			bits |= (uint32_t)*src++ << (i << 3);
 
-			if((coil_address - starting_address) >= quantity_of_coils)
-				break;
+		const word_alias *in = (const word_alias*)src;
+		for(uint16_t i = 1; i < words; ++i) {								// Last output word finishes from bytes, the aligned word holding them may run past the end
+			uint32_t next = *in++;
+			*out++ = __REV16(bits | (next << (head << 3)));
+			bits = next >> ((4 - head) << 3);
 		}
 
-		m_c_write_buffer[m_c_write_buffer_size++] = byte_value;
+		src = (const uint8_t*)in;
+		for(uint8_t i = head; i < 4; ++i)
+			bits |= (uint32_t)*src++ << (i << 3);
+		*out++ = __REV16(bits);
+	}
+	else if(words) {
+		const word_alias *in = (const word_alias*)src;
+		for(uint16_t i = 0; i < words; ++i)
+			*out++ = __REV16(*in++);
+		src = (const uint8_t*)in;
 	}
 
-	modbus_controller_write();
+	if(count & 0x01)
+		*(uint16_t*)out = (src[0] << 8) | src[1];
 }
 
-// Function 0x02: Read Discrete Inputs
-void process_read_discrete_inputs(void) {	// Functionally same as process_read_coils
-	if((m_c_read_buffer_size - MODBUS_CRC_BYTES) < (MODBUS_QUANTITY_OF_INPUTS_INDEX + 2))
-		return;
+void bitmap_set(uint32_t *bitmap, uint16_t first, uint16_t count) {	// Word at a time, like bitfield_insert
+	uint32_t end = (uint32_t)first + count;
 
-	uint16_t starting_address = (m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
-								(m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
+	for(uint32_t bit = first; bit < end; bit = (bit | 0x1F) + 1) {
+		uint32_t base = bit & ~0x1FUL, mask = 0xFFFFFFFFUL << (bit & 0x1F);
+		if((end - base) < 32)
+			mask &= (1UL << (end - base)) - 1;
 
-	if(starting_address >= (MODBUS_CONTROLLER_DISCRETE_INPUTS_BYTE_SIZE << 3)) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_ADDRESS);
-		modbus_controller_write();
-		return;
+		bitmap[bit >> 5] |= mask;
 	}
+}
 
-	uint16_t quantity_of_coils = (m_c_read_buffer[MODBUS_QUANTITY_OF_INPUTS_INDEX] << 8) |
-								 (m_c_read_buffer[MODBUS_QUANTITY_OF_INPUTS_INDEX + 1]);
+// Span walkers, address to address + quantity has to have passed span_mapped. Each region's share goes through the kernels in one piece
+void read_bits(uint8_t table, uint16_t address, uint16_t quantity, uint8_t *dst) {
+	for(uint16_t done = 0; done < quantity; ) {
+		modbus_controller_region *region = find_region(table, address);
+		uint16_t offset = address - region->base, count = region->length - offset;
+		if(count > quantity - done)
+			count = quantity - done;
 
-	if(
-		(((MODBUS_CONTROLLER_DISCRETE_INPUTS_BYTE_SIZE << 3) - starting_address) < quantity_of_coils) ||
-		(quantity_of_coils > 0x7D0) ||
-		(quantity_of_coils == 0)
-	) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_VALUE);
-		modbus_controller_write();
+		bitfield_extract(dst, done, (const uint8_t*)region->storage, offset, count);
+
+		address += count;
+		done += count;
+	}
+}
+
+void write_bits(uint8_t table, uint16_t address, uint16_t quantity, const uint8_t *src) {
+	for(uint16_t done = 0; done < quantity; ) {
+		modbus_controller_region *region = find_region(table, address);
+		uint16_t offset = address - region->base, count = region->length - offset;
+		if(count > quantity - done)
+			count = quantity - done;
+
+		bitfield_insert((uint32_t*)region->storage, offset, src, done, count, region->dirty);	// Only flipped coils come out dirty
+
+		address += count;
+		done += count;
+	}
+}
+
+void read_registers(uint8_t table, uint16_t address, uint16_t quantity, uint8_t *dst) {
+	for(uint16_t done = 0; done < quantity; ) {
+		modbus_controller_region *region = find_region(table, address);
+		uint16_t offset = address - region->base, count = region->length - offset;
+		if(count > quantity - done)
+			count = quantity - done;
+
+		copy_be16_from_host(&dst[done << 1], (const uint16_t*)region->storage + offset, count);
+
+		address += count;
+		done += count;
+	}
+}
+
+void write_registers(uint8_t table, uint16_t address, uint16_t quantity, const uint8_t *src) {
+	for(uint16_t done = 0; done < quantity; ) {
+		modbus_controller_region *region = find_region(table, address);
+		uint16_t offset = address - region->base, count = region->length - offset;
+		if(count > quantity - done)
+			count = quantity - done;
+
+		copy_host_from_be16((uint16_t*)region->storage + offset, &src[done << 1], count);
+		if(region->dirty != NULL)
+			bitmap_set(region->dirty, offset, count);
+
+		address += count;
+		done += count;
+	}
+}
+
+void process_read_coils(modbus_server_t *server);
+void process_read_discrete_inputs(modbus_server_t *server);
+void process_read_holding_registers(modbus_server_t *server);
+void process_read_input_registers(modbus_server_t *server);
+void process_write_single_coil(modbus_server_t *server);
+void process_write_single_register(modbus_server_t *server);
+void process_write_multiple_coils(modbus_server_t *server);
+void process_write_multiple_registers(modbus_server_t *server);
+void process_diagnostics(modbus_server_t *server);
+void process_get_comm_event_counter(modbus_server_t *server);
+
+// Indexed by function code. Minimum request sizes don't count CRC, +1 to include Lo portion of last field, +1 for count up to and including index
+static const modbus_controller_function m_c_functions[MODBUS_WRITE_MULTIPLE_REGISTERS + 1] = {
+#if MODBUS_CONTROLLER_READ_COILS
+	[MODBUS_READ_COILS] 				= {process_read_coils, 					MODBUS_QUANTITY_OF_COILS_INDEX + 2, 	true},
+#endif
+#if MODBUS_CONTROLLER_READ_DISCRETE_INPUTS
+	[MODBUS_READ_DISCRETE_INPUTS] 		= {process_read_discrete_inputs, 		MODBUS_QUANTITY_OF_INPUTS_INDEX + 2, 	true},
+#endif
+#if MODBUS_CONTROLLER_READ_HOLDING_REGISTERS
+	[MODBUS_READ_HOLDING_REGISTERS] 	= {process_read_holding_registers, 		MODBUS_QUANTITY_OF_REGISTERS_INDEX + 2, true},
+#endif
+#if MODBUS_CONTROLLER_READ_INPUT_REGISTERS
+	[MODBUS_READ_INPUT_REGISTERS] 		= {process_read_input_registers, 		MODBUS_QUANTITY_OF_REGISTERS_INDEX + 2, true},
+#endif
+#if MODBUS_CONTROLLER_WRITE_SINGLE_COIL
+	[MODBUS_WRITE_SINGLE_COIL] 			= {process_write_single_coil, 			MODBUS_WRITE_DATA_INDEX + 2, 			false},
+#endif
+#if MODBUS_CONTROLLER_WRITE_SINGLE_REGISTER
+	[MODBUS_WRITE_SINGLE_REGISTER] 		= {process_write_single_register, 		MODBUS_WRITE_DATA_INDEX + 2, 			false},
+#endif
+#if MODBUS_CONTROLLER_DIAGNOSTICS
+	[MODBUS_DIAGNOSTICS] 				= {process_diagnostics, 				MODBUS_DIAGNOSTIC_DATA_INDEX + 2, 		false},	// Some sub-functions clear counters
+#endif
+#if MODBUS_CONTROLLER_GET_COMM_EVENT_COUNTER
+	[MODBUS_GET_COMM_EVENT_COUNTER] 	= {process_get_comm_event_counter, 		MODBUS_FUNCTION_INDEX + 1, 				true},
+#endif
+#if MODBUS_CONTROLLER_WRITE_MULTIPLE_COILS
+	[MODBUS_WRITE_MULTPLE_COILS] 		= {process_write_multiple_coils, 		MODBUS_WRITE_BYTE_COUNT_INDEX + 1, 		false},
+#endif
+#if MODBUS_CONTROLLER_WRITE_MULTIPLE_REGISTERS
+	[MODBUS_WRITE_MULTIPLE_REGISTERS] 	= {process_write_multiple_registers, 	MODBUS_WRITE_BYTE_COUNT_INDEX + 1, 		false},
+#endif
+};
+
+// User-defined function code ranges, 65-72 then 100-110
+static modbus_controller_function m_c_user_functions[(72 - 65 + 1) + (110 - 100 + 1)];
+
+modbus_controller_function *user_function(uint8_t function) {
+	if((function >= 65) && (function <= 72))
+		return &m_c_user_functions[function - 65];
+	else if((function >= 100) && (function <= 110))
+		return &m_c_user_functions[(72 - 65 + 1) + function - 100];
+
+	return NULL;
+}
+
+const modbus_controller_function *find_function(uint8_t function) {	// NULL if function code isn't served
+	const modbus_controller_function *entry = (function <= MODBUS_WRITE_MULTIPLE_REGISTERS) ? &m_c_functions[function] : user_function(function);
+
+	return ((entry != NULL) && (entry->handler != NULL)) ? entry : NULL;
+}
+
+bool modbus_controller_register_function(uint8_t function, modbus_controller_handler handler, uint16_t min_request_bytes, bool speculative) {
+	modbus_controller_function *entry = user_function(function);
+
+	if(entry == NULL)
+		return false;
+
+	entry->handler = NULL;	// Not served while half written, PendSV may tick server in between
+	__DMB();	// Barrier keeps compiler from dropping the store above as dead or sinking field writes past it
+	entry->min_request_bytes = min_request_bytes;
+	entry->speculative = speculative;
+	__DMB();	// Fields land before handler publishes them
+	entry->handler = handler;
+
+	return true;
+}
+
+void process_modbus_message(modbus_server_t *server) {	// Appends device address and function to server->write_buffer, then processes function
+	server->write_buffer[MODBUS_ADDRESS_INDEX] = server->read_buffer[MODBUS_ADDRESS_INDEX];
+	server->write_buffer[MODBUS_FUNCTION_INDEX] = server->read_buffer[MODBUS_FUNCTION_INDEX];
+
+	server->write_buffer_size = MODBUS_MIN_MESSAGE_BYTES - MODBUS_CRC_BYTES;
+
+	server->replied = false;
+
+	const modbus_controller_function *function = find_function(server->read_buffer[MODBUS_FUNCTION_INDEX]);
+
+	if(function == NULL) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_FUNCTION);
+		modbus_controller_write(server);
+	}
+	else if((server->read_buffer_size - MODBUS_CRC_BYTES) >= function->min_request_bytes)
+		function->handler(server);
+
+	if(!server->replied)	// Request was too short to make sense of
+		++server->no_responses;
+}
+
+#if MODBUS_CONTROLLER_READ_COILS
+// Function 0x01: Read Coils
+void process_read_coils(modbus_server_t *server) {
+	uint16_t starting_address = (server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
+								(server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
+
+	uint16_t quantity_of_coils = (server->read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX] << 8) |
+								 (server->read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX + 1]);
+
+	if((quantity_of_coils > 0x7D0) || (quantity_of_coils == 0)) {	// Can only send back 2000 coils max
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
+		return;
+	}
+
+	if(!span_mapped(MODBUS_CONTROLLER_COILS, starting_address, quantity_of_coils, MODBUS_CONTROLLER_REGION_READ)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_ADDRESS);
+		modbus_controller_write(server);
 		return;
 	}
 
 	uint8_t byte_count = (quantity_of_coils + 7) >> 3;
 
-	m_c_write_buffer[MODBUS_READ_BYTE_COUNT_INDEX] = byte_count;
-	m_c_write_buffer_size = MODBUS_READ_BYTE_COUNT_INDEX + 1;
+	server->write_buffer[MODBUS_READ_BYTE_COUNT_INDEX] = byte_count;
+	server->write_buffer_size = MODBUS_READ_BYTE_COUNT_INDEX + 1;
 
-	uint16_t coil_address = starting_address;
-	for(uint8_t i = 0; i < byte_count; ++i) {
-		uint8_t byte_value = 0;
+	read_bits(MODBUS_CONTROLLER_COILS, starting_address, quantity_of_coils, &server->write_buffer[server->write_buffer_size]);
+	server->write_buffer_size += byte_count;
 
-		for(uint8_t bit = 0; bit < 8; ++bit) {
-			if(m_c_discrete_inputs[coil_address >> 3] & (1 << (coil_address & 0x07)))
-				byte_value |= (1 << bit);
+	modbus_controller_write(server);
+}
+#endif
 
-			++coil_address;
+#if MODBUS_CONTROLLER_READ_DISCRETE_INPUTS
+// Function 0x02: Read Discrete Inputs
+void process_read_discrete_inputs(modbus_server_t *server) {	// Functionally same as process_read_coils
+	uint16_t starting_address = (server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
+								(server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
 
-			if((coil_address - starting_address) >= quantity_of_coils)
-				break;
-		}
+	uint16_t quantity_of_coils = (server->read_buffer[MODBUS_QUANTITY_OF_INPUTS_INDEX] << 8) |
+								 (server->read_buffer[MODBUS_QUANTITY_OF_INPUTS_INDEX + 1]);
 
-		m_c_write_buffer[m_c_write_buffer_size++] = byte_value;
+	if((quantity_of_coils > 0x7D0) || (quantity_of_coils == 0)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
+		return;
+	}
+
+	if(!span_mapped(MODBUS_CONTROLLER_DISCRETE_INPUTS, starting_address, quantity_of_coils, MODBUS_CONTROLLER_REGION_READ)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_ADDRESS);
+		modbus_controller_write(server);
+		return;
 	}
 
-	modbus_controller_write();
+	uint8_t byte_count = (quantity_of_coils + 7) >> 3;
+
+	server->write_buffer[MODBUS_READ_BYTE_COUNT_INDEX] = byte_count;
+	server->write_buffer_size = MODBUS_READ_BYTE_COUNT_INDEX + 1;
+
+	read_bits(MODBUS_CONTROLLER_DISCRETE_INPUTS, starting_address, quantity_of_coils, &server->write_buffer[server->write_buffer_size]);
+	server->write_buffer_size += byte_count;
+
+	modbus_controller_write(server);
 }
+#endif
 
+#if MODBUS_CONTROLLER_READ_HOLDING_REGISTERS
 // Function 0x03: Read Holding Registers
-void process_read_holding_registers(void) {
-	if((m_c_read_buffer_size - MODBUS_CRC_BYTES) < (MODBUS_QUANTITY_OF_REGISTERS_INDEX + 2))
-		return;
+void process_read_holding_registers(modbus_server_t *server) {
+	uint16_t starting_address = (server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
+								(server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
 
-	uint16_t starting_address = (m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
-								(m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
+	uint16_t quantity_of_registers = (server->read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX] << 8) |
+									 (server->read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1]);
 
-	if(starting_address >= MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_ADDRESS);
-		modbus_controller_write();
+	if((quantity_of_registers > 0x7D) || (quantity_of_registers == 0)) {	// Can only send back 125 registers max
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint16_t quantity_of_registers = (m_c_read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX] << 8) |
-									 (m_c_read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1]);
-
-	if(
-		((MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE - starting_address) < quantity_of_registers) ||
-		(quantity_of_registers > 0x7D) ||																		// Can only send back 125 registers max
-		(quantity_of_registers == 0)
-	) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_VALUE);
-		modbus_controller_write();
+	if(!span_mapped(MODBUS_CONTROLLER_HOLDING_REGISTERS, starting_address, quantity_of_registers, MODBUS_CONTROLLER_REGION_READ)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_ADDRESS);
+		modbus_controller_write(server);
 		return;
 	}
 
-	m_c_write_buffer[MODBUS_READ_BYTE_COUNT_INDEX] = (quantity_of_registers << 1);
-	m_c_write_buffer_size = MODBUS_READ_BYTE_COUNT_INDEX + 1;
+	server->write_buffer[MODBUS_READ_BYTE_COUNT_INDEX] = (quantity_of_registers << 1);
+	server->write_buffer_size = MODBUS_READ_BYTE_COUNT_INDEX + 1;
 
-	for(uint16_t i = starting_address; (i - starting_address) < quantity_of_registers; ++i) {
-		m_c_write_buffer[m_c_write_buffer_size++] = m_c_holding_registers[i] >> 8;
-		m_c_write_buffer[m_c_write_buffer_size++] = m_c_holding_registers[i] & 0xFF;
-	}
+	read_registers(MODBUS_CONTROLLER_HOLDING_REGISTERS, starting_address, quantity_of_registers, &server->write_buffer[server->write_buffer_size]);
+	server->write_buffer_size += quantity_of_registers << 1;
 
-	modbus_controller_write();
+	modbus_controller_write(server);
 }
+#endif
 
+#if MODBUS_CONTROLLER_READ_INPUT_REGISTERS
 // Function 0x04: Read Input Registers
-void process_read_input_registers(void) {	// Functionally same as process_read_holding_registers
-	if((m_c_read_buffer_size - MODBUS_CRC_BYTES) < (MODBUS_QUANTITY_OF_REGISTERS_INDEX + 2))
-		return;
+void process_read_input_registers(modbus_server_t *server) {	// Functionally same as process_read_holding_registers
+	uint16_t starting_address = (server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
+								(server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
 
-	uint16_t starting_address = (m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
-								(m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
+	uint16_t quantity_of_registers = (server->read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX] << 8) |
+									 (server->read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1]);
 
-	if(starting_address >= MODBUS_CONTROLLER_INPUT_REGISTERS_SIZE) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_ADDRESS);
-		modbus_controller_write();
+	if((quantity_of_registers > 0x7D) || (quantity_of_registers == 0)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint16_t quantity_of_registers = (m_c_read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX] << 8) |
-									 (m_c_read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1]);
-
-	if(
-		((MODBUS_CONTROLLER_INPUT_REGISTERS_SIZE - starting_address) < quantity_of_registers) ||
-		(quantity_of_registers > 0x7D) ||
-		(quantity_of_registers == 0)
-	) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_VALUE);
-		modbus_controller_write();
+	if(!span_mapped(MODBUS_CONTROLLER_INPUT_REGISTERS, starting_address, quantity_of_registers, MODBUS_CONTROLLER_REGION_READ)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_ADDRESS);
+		modbus_controller_write(server);
 		return;
 	}
 
-	m_c_write_buffer[MODBUS_READ_BYTE_COUNT_INDEX] = (quantity_of_registers << 1);
-	m_c_write_buffer_size = MODBUS_READ_BYTE_COUNT_INDEX + 1;
+	server->write_buffer[MODBUS_READ_BYTE_COUNT_INDEX] = (quantity_of_registers << 1);
+	server->write_buffer_size = MODBUS_READ_BYTE_COUNT_INDEX + 1;
 
-	for(uint16_t i = starting_address; (i - starting_address) < quantity_of_registers; ++i) {
-		m_c_write_buffer[m_c_write_buffer_size++] = m_c_input_registers[i] >> 8;
-		m_c_write_buffer[m_c_write_buffer_size++] = m_c_input_registers[i] & 0xFF;
-	}
+	read_registers(MODBUS_CONTROLLER_INPUT_REGISTERS, starting_address, quantity_of_registers, &server->write_buffer[server->write_buffer_size]);
+	server->write_buffer_size += quantity_of_registers << 1;
 
-	modbus_controller_write();
+	modbus_controller_write(server);
 }
+#endif
 
+#if MODBUS_CONTROLLER_WRITE_SINGLE_COIL
 // Function 0x05: Write Single Coil
-void process_write_single_coil(void) {
-	if((m_c_read_buffer_size - MODBUS_CRC_BYTES) < (MODBUS_WRITE_DATA_INDEX + 2))
-		return;
+void process_write_single_coil(modbus_server_t *server) {
+	uint16_t coil_address = (server->read_buffer[MODBUS_COIL_ADDRESS_INDEX] << 8) |
+							(server->read_buffer[MODBUS_COIL_ADDRESS_INDEX + 1]);
 
-	uint16_t coil_address = (m_c_read_buffer[MODBUS_COIL_ADDRESS_INDEX] << 8) |
-							(m_c_read_buffer[MODBUS_COIL_ADDRESS_INDEX + 1]);
+	uint16_t coil_value = (server->read_buffer[MODBUS_WRITE_DATA_INDEX] << 8) |
+						  (server->read_buffer[MODBUS_WRITE_DATA_INDEX + 1]);
 
-	if(coil_address >= (MODBUS_CONTROLLER_COILS_BYTE_SIZE << 3)) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_ADDRESS);
-		modbus_controller_write();
+	if((coil_value != 0xFF00) && (coil_value != 0x0000)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint16_t coil_value = (m_c_read_buffer[MODBUS_WRITE_DATA_INDEX] << 8) |
-						  (m_c_read_buffer[MODBUS_WRITE_DATA_INDEX + 1]);
+	modbus_controller_region *region = find_region(MODBUS_CONTROLLER_COILS, coil_address);
 
-	if(coil_value == 0xFF00)
-		m_c_coils[coil_address >> 3] |= (1 << (coil_address & 0x07));
-	else if(coil_value == 0x0000)
-		m_c_coils[coil_address >> 3] &= ~(1 << (coil_address & 0x07));
-	else {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_VALUE);
-		modbus_controller_write();
+	if((region == NULL) || !(region->flags & MODBUS_CONTROLLER_REGION_WRITE)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_ADDRESS);
+		modbus_controller_write(server);
 		return;
 	}
 
-	m_c_write_buffer[MODBUS_COIL_ADDRESS_INDEX] 	= m_c_read_buffer[MODBUS_COIL_ADDRESS_INDEX];
-	m_c_write_buffer[MODBUS_COIL_ADDRESS_INDEX + 1] = m_c_read_buffer[MODBUS_COIL_ADDRESS_INDEX + 1];
-	m_c_write_buffer[MODBUS_WRITE_DATA_INDEX] 		= m_c_read_buffer[MODBUS_WRITE_DATA_INDEX];
-	m_c_write_buffer[MODBUS_WRITE_DATA_INDEX + 1]	= m_c_read_buffer[MODBUS_WRITE_DATA_INDEX + 1];
+	uint16_t offset = coil_address - region->base;
+	uint32_t *coils = region->storage, old = coils[offset >> 5];
+
+	if(coil_value == 0xFF00)
+		coils[offset >> 5] |= (1UL << (offset & 0x1F));
+	else
+		coils[offset >> 5] &= ~(1UL << (offset & 0x1F));
 
-	m_c_write_buffer_size = MODBUS_WRITE_DATA_INDEX + 2;	// +1 to include Lo portion of write data, +1 for count up to and including index
+	if(region->dirty != NULL)
+		region->dirty[offset >> 5] |= old ^ coils[offset >> 5];
 
-	modbus_controller_write();
+	server->write_buffer[MODBUS_COIL_ADDRESS_INDEX] 	= server->read_buffer[MODBUS_COIL_ADDRESS_INDEX];
+	server->write_buffer[MODBUS_COIL_ADDRESS_INDEX + 1] = server->read_buffer[MODBUS_COIL_ADDRESS_INDEX + 1];
+	server->write_buffer[MODBUS_WRITE_DATA_INDEX] 		= server->read_buffer[MODBUS_WRITE_DATA_INDEX];
+	server->write_buffer[MODBUS_WRITE_DATA_INDEX + 1]	= server->read_buffer[MODBUS_WRITE_DATA_INDEX + 1];
+
+	server->write_buffer_size = MODBUS_WRITE_DATA_INDEX + 2;	// +1 to include Lo portion of write data, +1 for count up to and including index
+
+	modbus_controller_write(server);
 }
+#endif
 
+#if MODBUS_CONTROLLER_WRITE_SINGLE_REGISTER
 // Function 0x06: Write Single Register
-void process_write_single_register(void) {
-	if((m_c_read_buffer_size - MODBUS_CRC_BYTES) < (MODBUS_WRITE_DATA_INDEX + 2))
-		return;
+void process_write_single_register(modbus_server_t *server) {
+	uint16_t register_address = (server->read_buffer[MODBUS_REGISTER_ADDRESS_INDEX] << 8) |
+								(server->read_buffer[MODBUS_REGISTER_ADDRESS_INDEX + 1]);
 
-	uint16_t register_address = (m_c_read_buffer[MODBUS_REGISTER_ADDRESS_INDEX] << 8) |
-								(m_c_read_buffer[MODBUS_REGISTER_ADDRESS_INDEX + 1]);
+	modbus_controller_region *region = find_region(MODBUS_CONTROLLER_HOLDING_REGISTERS, register_address);
 
-	if(register_address >= MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_ADDRESS);
-		modbus_controller_write();
+	if((region == NULL) || !(region->flags & MODBUS_CONTROLLER_REGION_WRITE)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_ADDRESS);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint16_t register_value = (m_c_read_buffer[MODBUS_WRITE_DATA_INDEX] << 8) |
-							  (m_c_read_buffer[MODBUS_WRITE_DATA_INDEX + 1]);
+	uint16_t register_value = (server->read_buffer[MODBUS_WRITE_DATA_INDEX] << 8) |
+							  (server->read_buffer[MODBUS_WRITE_DATA_INDEX + 1]);
+
+	uint16_t offset = register_address - region->base;
 
-	m_c_holding_registers[register_address] = register_value;
+	((uint16_t*)region->storage)[offset] = register_value;
 
-	m_c_write_buffer[MODBUS_REGISTER_ADDRESS_INDEX] 	= m_c_read_buffer[MODBUS_REGISTER_ADDRESS_INDEX];
-	m_c_write_buffer[MODBUS_REGISTER_ADDRESS_INDEX + 1] = m_c_read_buffer[MODBUS_REGISTER_ADDRESS_INDEX + 1];
-	m_c_write_buffer[MODBUS_WRITE_DATA_INDEX] 			= m_c_read_buffer[MODBUS_WRITE_DATA_INDEX];
-	m_c_write_buffer[MODBUS_WRITE_DATA_INDEX + 1] 		= m_c_read_buffer[MODBUS_WRITE_DATA_INDEX + 1];
+	if(region->dirty != NULL)
+		region->dirty[offset >> 5] |= 1UL << (offset & 0x1F);
 
-	m_c_write_buffer_size = MODBUS_WRITE_DATA_INDEX + 2;
+	server->write_buffer[MODBUS_REGISTER_ADDRESS_INDEX] 	= server->read_buffer[MODBUS_REGISTER_ADDRESS_INDEX];
+	server->write_buffer[MODBUS_REGISTER_ADDRESS_INDEX + 1] = server->read_buffer[MODBUS_REGISTER_ADDRESS_INDEX + 1];
+	server->write_buffer[MODBUS_WRITE_DATA_INDEX] 			= server->read_buffer[MODBUS_WRITE_DATA_INDEX];
+	server->write_buffer[MODBUS_WRITE_DATA_INDEX + 1] 		= server->read_buffer[MODBUS_WRITE_DATA_INDEX + 1];
 
-	modbus_controller_write();
+	server->write_buffer_size = MODBUS_WRITE_DATA_INDEX + 2;
+
+	modbus_controller_write(server);
 }
+#endif
 
+#if MODBUS_CONTROLLER_WRITE_MULTIPLE_COILS
 // Function 0x0F: Write Multiple Coils
-void process_write_multiple_coils(void) {
-	if((m_c_read_buffer_size - MODBUS_CRC_BYTES) < (MODBUS_WRITE_BYTE_COUNT_INDEX + 1))
-		return;
+void process_write_multiple_coils(modbus_server_t *server) {
+	uint16_t starting_address = (server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
+								(server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
 
-	uint16_t starting_address = (m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
-								(m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
+	uint16_t quantity_of_coils = (server->read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX] << 8) |
+								 (server->read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX + 1]);
 
-	if(starting_address >= (MODBUS_CONTROLLER_COILS_BYTE_SIZE << 3)) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_ADDRESS);
-		modbus_controller_write();
+	if((quantity_of_coils > 0x7B0) || (quantity_of_coils == 0)) {	// Can only write 1968 coils max
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint16_t quantity_of_coils = (m_c_read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX] << 8) |
-								 (m_c_read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX + 1]);
+	uint8_t byte_count = server->read_buffer[MODBUS_WRITE_BYTE_COUNT_INDEX];
 
 	if(
-		(((MODBUS_CONTROLLER_COILS_BYTE_SIZE << 3) - starting_address) < quantity_of_coils) ||
-		(quantity_of_coils > 0x7B0) ||																			// Can only write 1968 coils max
-		(quantity_of_coils == 0)
+		(byte_count != ((quantity_of_coils + 7) >> 3)) ||
+		(server->read_buffer_size - MODBUS_CRC_BYTES - (MODBUS_WRITE_BYTE_COUNT_INDEX + 1)) < byte_count
 	) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_VALUE);
-		modbus_controller_write();
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint8_t byte_count = m_c_read_buffer[MODBUS_WRITE_BYTE_COUNT_INDEX];
-
-	if(
-		(byte_count != ((quantity_of_coils + 7) >> 3)) ||
-		(m_c_read_buffer_size - MODBUS_CRC_BYTES - (MODBUS_WRITE_BYTE_COUNT_INDEX + 1)) < byte_count
-	) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_VALUE);
-		modbus_controller_write();
+	if(!span_mapped(MODBUS_CONTROLLER_COILS, starting_address, quantity_of_coils, MODBUS_CONTROLLER_REGION_WRITE)) {	// Checked whole before anything is written
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_ADDRESS);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint16_t coil_address = starting_address;
-	for(uint8_t i = 0; i < byte_count; ++i) {
-		for(uint8_t bit = 0; bit < 8; ++bit) {
-			if(m_c_read_buffer[MODBUS_WRITE_BYTE_COUNT_INDEX + 1 + i] & (1 << bit))
-				m_c_coils[coil_address >> 3] |= (1 << (coil_address & 0x07));
-			else
-				m_c_coils[coil_address >> 3] &= ~(1 << (coil_address & 0x07));
-
-			++coil_address;
-
-			if((coil_address - starting_address) >= quantity_of_coils)
-				break;
-		}
-	}
+	write_bits(MODBUS_CONTROLLER_COILS, starting_address, quantity_of_coils, &server->read_buffer[MODBUS_WRITE_BYTE_COUNT_INDEX + 1]);
 
-	m_c_write_buffer[MODBUS_STARTING_ADDRESS_INDEX] 		= m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX];
-	m_c_write_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1] 	= m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1];
-	m_c_write_buffer[MODBUS_QUANTITY_OF_COILS_INDEX] 		= m_c_read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX];
-	m_c_write_buffer[MODBUS_QUANTITY_OF_COILS_INDEX + 1]	= m_c_read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX + 1];
+	server->write_buffer[MODBUS_STARTING_ADDRESS_INDEX] 		= server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX];
+	server->write_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1] 	= server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1];
+	server->write_buffer[MODBUS_QUANTITY_OF_COILS_INDEX] 		= server->read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX];
+	server->write_buffer[MODBUS_QUANTITY_OF_COILS_INDEX + 1]	= server->read_buffer[MODBUS_QUANTITY_OF_COILS_INDEX + 1];
 
-	m_c_write_buffer_size = MODBUS_QUANTITY_OF_COILS_INDEX + 2;
+	server->write_buffer_size = MODBUS_QUANTITY_OF_COILS_INDEX + 2;
 
-	modbus_controller_write();
+	modbus_controller_write(server);
 }
+#endif
 
+#if MODBUS_CONTROLLER_WRITE_MULTIPLE_REGISTERS
 // Function 0x10: Write Multiple Registers
-void process_write_multiple_registers(void) {
-	if((m_c_read_buffer_size - MODBUS_CRC_BYTES) < (MODBUS_WRITE_BYTE_COUNT_INDEX + 1))
-		return;
+void process_write_multiple_registers(modbus_server_t *server) {
+	uint16_t starting_address = (server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
+								(server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
 
-	uint16_t starting_address = (m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX] << 8) |
-								(m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1]);
+	uint16_t quantity_of_registers = (server->read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX] << 8) |
+									 (server->read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1]);
 
-	if(starting_address >= MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_ADDRESS);
-		modbus_controller_write();
+	if((quantity_of_registers > 0x7B) || (quantity_of_registers == 0)) {	// Can only write 123 registers max
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint16_t quantity_of_registers = (m_c_read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX] << 8) |
-									 (m_c_read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1]);
+	uint8_t byte_count = server->read_buffer[MODBUS_WRITE_BYTE_COUNT_INDEX];
 
 	if(
-		((MODBUS_CONTROLLER_HOLDING_REGISTERS_SIZE - starting_address) < quantity_of_registers) ||
-		(quantity_of_registers > 0x7B) ||																		// Can only write 123 registers max
-		(quantity_of_registers == 0)
+		(byte_count >> 1) != quantity_of_registers ||
+		(server->read_buffer_size - MODBUS_CRC_BYTES - (MODBUS_WRITE_BYTE_COUNT_INDEX + 1)) < byte_count
 	) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_VALUE);
-		modbus_controller_write();
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint8_t byte_count = m_c_read_buffer[MODBUS_WRITE_BYTE_COUNT_INDEX];
+	if(!span_mapped(MODBUS_CONTROLLER_HOLDING_REGISTERS, starting_address, quantity_of_registers, MODBUS_CONTROLLER_REGION_WRITE)) {
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_ADDRESS);
+		modbus_controller_write(server);
+		return;
+	}
+
+	write_registers(MODBUS_CONTROLLER_HOLDING_REGISTERS, starting_address, quantity_of_registers, &server->read_buffer[MODBUS_WRITE_BYTE_COUNT_INDEX + 1]);
+
+	server->write_buffer[MODBUS_STARTING_ADDRESS_INDEX] 			= server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX];
+	server->write_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1] 		= server->read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1];
+	server->write_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX] 		= server->read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX];
+	server->write_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1]	= server->read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1];
+
+	server->write_buffer_size = MODBUS_QUANTITY_OF_REGISTERS_INDEX + 2;
+
+	modbus_controller_write(server);
+}
+#endif
+
+#if MODBUS_CONTROLLER_DIAGNOSTICS
+void clear_counters(modbus_server_t *server) {
+	server->crc_errors = 0;
+	server->exceptions = 0;
+	server->server_messages = 0;
+	server->no_responses = 0;
+	server->comm_events = 0;
+
+	modbus_io_line(server->io, &server->line_cleared);
+}
+
+// Function 0x08: Diagnostics
+void process_diagnostics(modbus_server_t *server) {
+	uint16_t sub_function = (server->read_buffer[MODBUS_SUB_FUNCTION_INDEX] << 8) |
+							(server->read_buffer[MODBUS_SUB_FUNCTION_INDEX + 1]);
+
+	uint16_t data = (server->read_buffer[MODBUS_DIAGNOSTIC_DATA_INDEX] << 8) |
+					(server->read_buffer[MODBUS_DIAGNOSTIC_DATA_INDEX + 1]);
+
+	// Every sub-function echoes sub-function code and data field back, counters then overwrite data
+	server->write_buffer_size = server->read_buffer_size - MODBUS_CRC_BYTES;
+	memcpy(&server->write_buffer[MODBUS_SUB_FUNCTION_INDEX], &server->read_buffer[MODBUS_SUB_FUNCTION_INDEX], server->write_buffer_size - MODBUS_SUB_FUNCTION_INDEX);
+
+	if(sub_function == MODBUS_RETURN_QUERY_DATA) {	// Data field may be any length
+		modbus_controller_write(server);
+		return;
+	}
+
+	modbus_io_line_stats line;
+	modbus_io_line(server->io, &line);
+
+	uint16_t counter = 0;
+	switch(sub_function) {	// Unknown sub-function is rejected before its data field is looked at
+		case MODBUS_RESTART_COMMUNICATIONS_OPTION:
+		case MODBUS_CLEAR_COUNTERS_AND_DIAGNOSTIC_REGISTER:
+		case MODBUS_CLEAR_OVERRUN_COUNTER_AND_FLAG:
+			break;	// Cleared below, once data field checks out
+		case MODBUS_RETURN_DIAGNOSTIC_REGISTER:
+		case MODBUS_RETURN_SERVER_NAK_COUNT:
+		case MODBUS_RETURN_SERVER_BUSY_COUNT:
+			break;	// No diagnostic register, and NAK & busy are never replied
+		case MODBUS_RETURN_BUS_MESSAGE_COUNT:
+			counter = line.bus_messages - server->line_cleared.bus_messages;
+			break;
+		case MODBUS_RETURN_BUS_COMMUNICATION_ERROR_COUNT:
+			counter = server->crc_errors + (line.line_errors - server->line_cleared.line_errors);	// Frames hit by line errors never reach CRC check
+			break;
+		case MODBUS_RETURN_BUS_EXCEPTION_ERROR_COUNT:
+			counter = server->exceptions;
+			break;
+		case MODBUS_RETURN_SERVER_MESSAGE_COUNT:
+			counter = server->server_messages;
+			break;
+		case MODBUS_RETURN_SERVER_NO_RESPONSE_COUNT:
+			counter = server->no_responses;
+			break;
+		case MODBUS_RETURN_BUS_CHARACTER_OVERRUN_COUNT:
+			counter = line.character_overruns - server->line_cleared.character_overruns;
+			break;
+		default:
+			modbus_controller_exception(server, MODBUS_ILLEGAL_FUNCTION);
+			modbus_controller_write(server);
+			return;
+	}
 
 	if(
-		(byte_count >> 1) != quantity_of_registers ||
-		(m_c_read_buffer_size - MODBUS_CRC_BYTES - (MODBUS_WRITE_BYTE_COUNT_INDEX + 1)) < byte_count
+		(server->write_buffer_size != (MODBUS_DIAGNOSTIC_DATA_INDEX + 2)) ||
+		((data != 0x0000) && !((sub_function == MODBUS_RESTART_COMMUNICATIONS_OPTION) && (data == 0xFF00)))	// 0xFF00 would also clear event log, which isn't kept
 	) {
-		modbus_controller_exception(MODBUS_ILLEGAL_DATA_VALUE);
-		modbus_controller_write();
+		modbus_controller_exception(server, MODBUS_ILLEGAL_DATA_VALUE);
+		modbus_controller_write(server);
 		return;
 	}
 
-	uint16_t data_index = MODBUS_WRITE_BYTE_COUNT_INDEX + 1;
-	for(uint16_t i = starting_address; (i - starting_address) < quantity_of_registers; ++i) {
-		m_c_holding_registers[i] = m_c_read_buffer[data_index++] << 8;
-		m_c_holding_registers[i] |= m_c_read_buffer[data_index++];
+	if((sub_function == MODBUS_RESTART_COMMUNICATIONS_OPTION) || (sub_function == MODBUS_CLEAR_COUNTERS_AND_DIAGNOSTIC_REGISTER)) {
+		clear_counters(server);
+		modbus_controller_write(server);
+		return;
+	}
+	else if(sub_function == MODBUS_CLEAR_OVERRUN_COUNTER_AND_FLAG) {
+		server->line_cleared.character_overruns = line.character_overruns;
+		modbus_controller_write(server);
+		return;
 	}
 
-	m_c_write_buffer[MODBUS_STARTING_ADDRESS_INDEX] 			= m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX];
-	m_c_write_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1] 		= m_c_read_buffer[MODBUS_STARTING_ADDRESS_INDEX + 1];
-	m_c_write_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX] 		= m_c_read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX];
-	m_c_write_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1]	= m_c_read_buffer[MODBUS_QUANTITY_OF_REGISTERS_INDEX + 1];
+	server->write_buffer[MODBUS_DIAGNOSTIC_DATA_INDEX] 		= counter >> 8;
+	server->write_buffer[MODBUS_DIAGNOSTIC_DATA_INDEX + 1] 	= counter & 0xFF;
+
+	modbus_controller_write(server);
+}
+#endif
+
+#if MODBUS_CONTROLLER_GET_COMM_EVENT_COUNTER
+// Function 0x0B: Get Comm Event Counter
+void process_get_comm_event_counter(modbus_server_t *server) {
+	server->write_buffer[MODBUS_COMM_EVENT_STATUS_INDEX] 		= 0x00;	// Never busy, previous request has always been processed by now
+	server->write_buffer[MODBUS_COMM_EVENT_STATUS_INDEX + 1] 	= 0x00;
+	server->write_buffer[MODBUS_COMM_EVENT_COUNT_INDEX] 		= server->comm_events >> 8;
+	server->write_buffer[MODBUS_COMM_EVENT_COUNT_INDEX + 1] 	= server->comm_events & 0xFF;
 
-	m_c_write_buffer_size = MODBUS_QUANTITY_OF_REGISTERS_INDEX + 2;
+	server->write_buffer_size = MODBUS_COMM_EVENT_COUNT_INDEX + 2;
 
-	modbus_controller_write();
+	modbus_controller_write(server);
 }
+#endif
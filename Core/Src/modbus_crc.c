@@ -0,0 +1,153 @@
+#include "modbus_crc.h"
+
+#if MODBUS_CRC_ENGINE == MODBUS_CRC_NIBBLE
+// Reflected CRC-16/MODBUS, one entry per low nibble of CRC ^ data
+const uint16_t modbus_crc_nibble_table[16] = {
+   0X0000, 0XCC01, 0XD801, 0X1400, 0XF001, 0X3C00, 0X2800, 0XE401,
+   0XA001, 0X6C00, 0X7800, 0XB401, 0X5000, 0X9C01, 0X8801, 0X4400
+};
+#else
+// Reflected CRC-16/MODBUS, one entry per low byte of CRC ^ data
+const uint16_t modbus_crc_table[256] = {
+   0X0000, 0XC0C1, 0XC181, 0X0140, 0XC301, 0X03C0, 0X0280, 0XC241,
+   0XC601, 0X06C0, 0X0780, 0XC741, 0X0500, 0XC5C1, 0XC481, 0X0440,
+   0XCC01, 0X0CC0, 0X0D80, 0XCD41, 0X0F00, 0XCFC1, 0XCE81, 0X0E40,
+   0X0A00, 0XCAC1, 0XCB81, 0X0B40, 0XC901, 0X09C0, 0X0880, 0XC841,
+   0XD801, 0X18C0, 0X1980, 0XD941, 0X1B00, 0XDBC1, 0XDA81, 0X1A40,
+   0X1E00, 0XDEC1, 0XDF81, 0X1F40, 0XDD01, 0X1DC0, 0X1C80, 0XDC41,
+   0X1400, 0XD4C1, 0XD581, 0X1540, 0XD701, 0X17C0, 0X1680, 0XD641,
+   0XD201, 0X12C0, 0X1380, 0XD341, 0X1100, 0XD1C1, 0XD081, 0X1040,
+   0XF001, 0X30C0, 0X3180, 0XF141, 0X3300, 0XF3C1, 0XF281, 0X3240,
+   0X3600, 0XF6C1, 0XF781, 0X3740, 0XF501, 0X35C0, 0X3480, 0XF441,
+   0X3C00, 0XFCC1, 0XFD81, 0X3D40, 0XFF01, 0X3FC0, 0X3E80, 0XFE41,
+   0XFA01, 0X3AC0, 0X3B80, 0XFB41, 0X3900, 0XF9C1, 0XF881, 0X3840,
+   0X2800, 0XE8C1, 0XE981, 0X2940, 0XEB01, 0X2BC0, 0X2A80, 0XEA41,
+   0XEE01, 0X2EC0, 0X2F80, 0XEF41, 0X2D00, 0XEDC1, 0XEC81, 0X2C40,
+   0XE401, 0X24C0, 0X2580, 0XE541, 0X2700, 0XE7C1, 0XE681, 0X2640,
+   0X2200, 0XE2C1, 0XE381, 0X2340, 0XE101, 0X21C0, 0X2080, 0XE041,
+   0XA001, 0X60C0, 0X6180, 0XA141, 0X6300, 0XA3C1, 0XA281, 0X6240,
+   0X6600, 0XA6C1, 0XA781, 0X6740, 0XA501, 0X65C0, 0X6480, 0XA441,
+   0X6C00, 0XACC1, 0XAD81, 0X6D40, 0XAF01, 0X6FC0, 0X6E80, 0XAE41,
+   0XAA01, 0X6AC0, 0X6B80, 0XAB41, 0X6900, 0XA9C1, 0XA881, 0X6840,
+   0X7800, 0XB8C1, 0XB981, 0X7940, 0XBB01, 0X7BC0, 0X7A80, 0XBA41,
+   0XBE01, 0X7EC0, 0X7F80, 0XBF41, 0X7D00, 0XBDC1, 0XBC81, 0X7C40,
+   0XB401, 0X74C0, 0X7580, 0XB541, 0X7700, 0XB7C1, 0XB681, 0X7640,
+   0X7200, 0XB2C1, 0XB381, 0X7340, 0XB101, 0X71C0, 0X7080, 0XB041,
+   0X5000, 0X90C1, 0X9181, 0X5140, 0X9301, 0X53C0, 0X5280, 0X9241,
+   0X9601, 0X56C0, 0X5780, 0X9741, 0X5500, 0X95C1, 0X9481, 0X5440,
+   0X9C01, 0X5CC0, 0X5D80, 0X9D41, 0X5F00, 0X9FC1, 0X9E81, 0X5E40,
+   0X5A00, 0X9AC1, 0X9B81, 0X5B40, 0X9901, 0X59C0, 0X5880, 0X9841,
+   0X8801, 0X48C0, 0X4980, 0X8941, 0X4B00, 0X8BC1, 0X8A81, 0X4A40,
+   0X4E00, 0X8EC1, 0X8F81, 0X4F40, 0X8D01, 0X4DC0, 0X4C80, 0X8C41,
+   0X4400, 0X84C1, 0X8581, 0X4540, 0X8701, 0X47C0, 0X4680, 0X8641,
+   0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040
+};
+#endif
+
+#if MODBUS_CRC_ENGINE == MODBUS_CRC_SLICE_BY_4
+// A table is linear in its index, so 8 entries, one per set bit, describe all 256. Row 0's come from shifting the polynomial 8 times,
+// row k + 1 is row k followed by a zero byte. Enums keep every step an integer constant expression, so nothing runs at startup
+#define MODBUS_CRC_SHIFT(c)				(((c) >> 1) ^ (((c) & 1) ? 0xA001 : 0))
+#define MODBUS_CRC_SHIFT_8(c)			MODBUS_CRC_SHIFT(MODBUS_CRC_SHIFT(MODBUS_CRC_SHIFT(MODBUS_CRC_SHIFT( \
+										MODBUS_CRC_SHIFT(MODBUS_CRC_SHIFT(MODBUS_CRC_SHIFT(MODBUS_CRC_SHIFT(c))))))))
+#define MODBUS_CRC_ENTRY(k, b)			((((b) & 0x01) ? m_c_basis_##k##_0 : 0) ^ (((b) & 0x02) ? m_c_basis_##k##_1 : 0) ^ \
+										 (((b) & 0x04) ? m_c_basis_##k##_2 : 0) ^ (((b) & 0x08) ? m_c_basis_##k##_3 : 0) ^ \
+										 (((b) & 0x10) ? m_c_basis_##k##_4 : 0) ^ (((b) & 0x20) ? m_c_basis_##k##_5 : 0) ^ \
+										 (((b) & 0x40) ? m_c_basis_##k##_6 : 0) ^ (((b) & 0x80) ? m_c_basis_##k##_7 : 0))
+#define MODBUS_CRC_NEXT(k, j)			((m_c_basis_##k##_##j >> 8) ^ MODBUS_CRC_ENTRY(0, m_c_basis_##k##_##j & 0xFF))
+#define MODBUS_CRC_BASIS(k, prev)		m_c_basis_##k##_0 = MODBUS_CRC_NEXT(prev, 0), m_c_basis_##k##_1 = MODBUS_CRC_NEXT(prev, 1), \
+										m_c_basis_##k##_2 = MODBUS_CRC_NEXT(prev, 2), m_c_basis_##k##_3 = MODBUS_CRC_NEXT(prev, 3), \
+										m_c_basis_##k##_4 = MODBUS_CRC_NEXT(prev, 4), m_c_basis_##k##_5 = MODBUS_CRC_NEXT(prev, 5), \
+										m_c_basis_##k##_6 = MODBUS_CRC_NEXT(prev, 6), m_c_basis_##k##_7 = MODBUS_CRC_NEXT(prev, 7)
+
+enum {
+	m_c_basis_0_0 = MODBUS_CRC_SHIFT_8(0x01), m_c_basis_0_1 = MODBUS_CRC_SHIFT_8(0x02),
+	m_c_basis_0_2 = MODBUS_CRC_SHIFT_8(0x04), m_c_basis_0_3 = MODBUS_CRC_SHIFT_8(0x08),
+	m_c_basis_0_4 = MODBUS_CRC_SHIFT_8(0x10), m_c_basis_0_5 = MODBUS_CRC_SHIFT_8(0x20),
+	m_c_basis_0_6 = MODBUS_CRC_SHIFT_8(0x40), m_c_basis_0_7 = MODBUS_CRC_SHIFT_8(0x80),
+	MODBUS_CRC_BASIS(1, 0),
+	MODBUS_CRC_BASIS(2, 1),
+	MODBUS_CRC_BASIS(3, 2)
+};
+
+#define MODBUS_CRC_ROW_4(k, b)			MODBUS_CRC_ENTRY(k, (b)), MODBUS_CRC_ENTRY(k, (b) + 1), MODBUS_CRC_ENTRY(k, (b) + 2), MODBUS_CRC_ENTRY(k, (b) + 3)
+#define MODBUS_CRC_ROW_16(k, b)			MODBUS_CRC_ROW_4(k, (b)), MODBUS_CRC_ROW_4(k, (b) + 4), MODBUS_CRC_ROW_4(k, (b) + 8), MODBUS_CRC_ROW_4(k, (b) + 12)
+#define MODBUS_CRC_ROW_64(k, b)			MODBUS_CRC_ROW_16(k, (b)), MODBUS_CRC_ROW_16(k, (b) + 16), MODBUS_CRC_ROW_16(k, (b) + 32), MODBUS_CRC_ROW_16(k, (b) + 48)
+#define MODBUS_CRC_ROW(k)				{MODBUS_CRC_ROW_64(k, 0), MODBUS_CRC_ROW_64(k, 64), MODBUS_CRC_ROW_64(k, 128), MODBUS_CRC_ROW_64(k, 192)}
+
+// Row k is the CRC of a byte followed by k zero bytes, row 0 is modbus_crc_table
+const uint16_t modbus_crc_slice_tables[3][256] = {MODBUS_CRC_ROW(1), MODBUS_CRC_ROW(2), MODBUS_CRC_ROW(3)};
+#endif
+
+void modbus_crc_init(void) {
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_HARDWARE
+	__HAL_RCC_CRC_CLK_ENABLE();
+
+	CRC->POL = 0x8005;
+	CRC->INIT = 0xFFFF;
+	CRC->CR = CRC_CR_POLYSIZE_0 | CRC_CR_REV_IN_0 | CRC_CR_REV_OUT;	// 16 bit polynomial, input reversed per byte, output reversed
+
+#if MODBUS_CRC_DMA
+	__HAL_RCC_DMA1_CLK_ENABLE();
+
+	MODBUS_CRC_DMA_DMAMUX_CHANNEL->CCR = 0;	// No request line, memory-to-memory runs flat out
+	MODBUS_CRC_DMA_CHANNEL->CCR = DMA_CCR_MEM2MEM | DMA_CCR_MINC | DMA_CCR_DIR;	// Byte to byte, memory to CRC->DR, no interrupts, enabled per CRC
+	MODBUS_CRC_DMA_CHANNEL->CPAR = (uint32_t)&CRC->DR;
+#endif
+#endif
+}
+
+#if (MODBUS_CRC_BACKEND == MODBUS_CRC_HARDWARE) && !MODBUS_CRC_DMA
+typedef uint32_t word_alias __attribute__((__may_alias__));	// Lets a byte buffer be fed a word at a time
+#endif
+
+uint16_t modbus_crc(const uint8_t *data, uint16_t length) {
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_HARDWARE
+	CRC->CR |= CRC_CR_RESET;	// Reloads INIT
+
+#if MODBUS_CRC_DMA
+	if(length > 0) {
+		MODBUS_CRC_DMA_CHANNEL->CMAR = (uint32_t)data;
+		MODBUS_CRC_DMA_CHANNEL->CNDTR = length;
+		MODBUS_CRC_DMA_CHANNEL->CCR |= DMA_CCR_EN;
+
+		while(!(DMA1->ISR & MODBUS_CRC_DMA_TC_FLAG));
+
+		MODBUS_CRC_DMA_CHANNEL->CCR &= ~DMA_CCR_EN;
+		DMA1->IFCR = MODBUS_CRC_DMA_CLEAR_FLAGS;
+	}
+#else
+	while((length > 0) && ((uintptr_t)data & 0x03)) {	// Bytes until word aligned, M0+ can't load unaligned words
+		*(volatile uint8_t*)&CRC->DR = *data++;
+		--length;
+	}
+
+	for(; length >= 4; length -= 4, data += 4)
+		CRC->DR = __REV(*(const word_alias*)data);	// Unit takes most significant byte first, so first byte in memory goes on top
+
+	while(length-- > 0)
+		*(volatile uint8_t*)&CRC->DR = *data++;
+#endif
+
+	return CRC->DR & 0xFFFF;
+#else
+	return modbus_crc_software(data, length);
+#endif
+}
+
+uint16_t modbus_crc_software(const uint8_t *data, uint16_t length) {
+	uint16_t crc = 0xFFFF;
+
+#if MODBUS_CRC_ENGINE == MODBUS_CRC_SLICE_BY_4
+	for(; length >= 4; length -= 4, data += 4) {	// CRC is only 16 bits, so first two bytes fold into it and last two go straight in
+		crc ^= data[0] | (data[1] << 8);
+		crc = modbus_crc_slice_tables[2][crc & 0xFF] ^ modbus_crc_slice_tables[1][crc >> 8] ^
+			  modbus_crc_slice_tables[0][data[2]] ^ modbus_crc_table[data[3]];
+	}
+#endif
+
+	for(uint16_t i = 0; i < length; ++i)
+		crc = MODBUS_CRC_UPDATE(crc, data[i]);
+
+	return crc;
+}
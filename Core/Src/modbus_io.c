@@ -1,26 +1,117 @@
 #include "modbus_io.h"
+#include "modbus_crc.h"
 #include <stdbool.h>
 #include <string.h>
 
-static volatile UART_HandleTypeDef* modbus_io_huart;
-static volatile TIM_HandleTypeDef*  modbus_io_htim;
+#define MODBUS_IO_NO_FRAME 0xFF
 
-static volatile bool frame_new = true, frame_end = true;
+// Integer only, soft-float routines would take a sizeable chunk of the 64K flash. Times are in bits, rounded up
+void character_times(modbus_io_t *io, uint32_t baud, uint32_t *char_1_5_bits, uint32_t *char_3_5_bits) {
+	uint32_t half_bits_per_char = 2;	// Start bit. Word length already includes parity bit
+	switch(io->huart->Init.WordLength) {
+		case UART_WORDLENGTH_7B: half_bits_per_char += 14; break;
+		case UART_WORDLENGTH_8B: half_bits_per_char += 16; break;
+		case UART_WORDLENGTH_9B: half_bits_per_char += 18; break;
+	}
+	switch(io->huart->Init.StopBits) {
+		case UART_STOPBITS_0_5: half_bits_per_char += 1; break;
+		case UART_STOPBITS_1: 	half_bits_per_char += 2; break;
+		case UART_STOPBITS_1_5: half_bits_per_char += 3; break;
+		case UART_STOPBITS_2:	half_bits_per_char += 4; break;
+	}
+
+#if MODBUS_IO_SPEC_TIMEOUTS
+	if(baud > 19200) {	// Spec fixes timeouts to 750 us & 1750 us above 19200 baud
+		*char_1_5_bits = (baud * 3 + 3999) / 4000;
+		*char_3_5_bits = (baud * 7 + 3999) / 4000;
+		return;
+	}
+#endif
 
-static volatile uint8_t modbus_io_transmit_head = 0;
-static volatile uint16_t modbus_io_transmit_size = 0;
-static volatile uint8_t modbus_io_transmit_buffer[MODBUS_IO_BUFFER_SIZE];
+	*char_1_5_bits = (half_bits_per_char * 3 + 3) / 4;
+	*char_3_5_bits = (half_bits_per_char * 7 + 3) / 4;
+}
+
+// Derives timer prescaler, character times and reply window from current BRR & frame format. Safe to call again whenever those change
+uint32_t actual_baud(modbus_io_t *io) {	// Rate BRR gives, rounded
+	uint32_t freq = io->huart_kernel_freq, divider = io->huart->Instance->BRR;
+	if(io->huart->Instance->CR1 & USART_CR1_OVER8) {	// BRR[2:0] holds USARTDIV[3:1]
+		freq *= 2;
+		divider = (divider & ~0xFU) | ((divider & 0x7U) << 1);
+	}
 
-static volatile uint16_t modbus_io_receive_size = 0;
-static volatile uint8_t modbus_io_receive_buffer[MODBUS_IO_BUFFER_SIZE];
+	return (freq + divider / 2) / divider;
+}
 
-static volatile uint16_t modbus_io_read_size = 0;
-static volatile uint8_t modbus_io_read_buffer[MODBUS_IO_BUFFER_SIZE];
+void configure_timing(modbus_io_t *io) {
+	uint32_t baud = actual_baud(io);
 
-void modbus_io_init(UART_HandleTypeDef* _modbus_io_huart, uint32_t modbus_io_huart_freq, TIM_HandleTypeDef* _modbus_io_htim, uint32_t modbus_io_tim_freq) {
-	modbus_io_huart = _modbus_io_huart;
+	io->huart->Init.BaudRate = baud;
+
+	io->htim->Instance->PSC = (io->tim_kernel_freq + baud / 2) / baud - 1;	// One tick per bit
+
+	uint32_t char_1_5_bits, char_3_5_bits;
+	character_times(io, baud, &char_1_5_bits, &char_3_5_bits);
+
+	io->htim->Instance->CCR1 = char_1_5_bits;
+	io->htim->Instance->CCR2 = char_3_5_bits;
+	io->htim->Instance->CCR3 = char_3_5_bits + io->min_reply_bits;
+	io->htim->Instance->CCR4 = char_3_5_bits + io->max_reply_bits;
+
+	if(io->max_reply_bits > 0)
+		io->htim->Instance->ARR = io->htim->Instance->CCR4; // Just needs to be >= CCR4, stops earlier too
+	else
+		io->htim->Instance->ARR = io->counter_max;				// Keeps counting so turnaround can be measured, however late reply is
+
+	io->htim->Instance->EGR |= TIM_EGR_UG; // Update registers to configured values
+	io->htim->Instance->SR &= ~TIM_SR_UIF; // Necessary after update generation
+
+	io->huart->Instance->RTOR = char_3_5_bits & USART_RTOR_RTO;	// Counted from end of last stop bit, only used by receiver timeout modes
+}
 
-	switch(modbus_io_huart->Init.ClockPrescaler) {
+void modbus_io_dma(
+	modbus_io_t *io,
+	DMA_Channel_TypeDef *rx_channel, DMAMUX_Channel_TypeDef *rx_dmamux_channel, uint32_t rx_request,
+	DMA_Channel_TypeDef *tx_channel, DMAMUX_Channel_TypeDef *tx_dmamux_channel, uint32_t tx_request
+) {
+	io->rx_dma_channel = rx_channel;
+	io->rx_dmamux_channel = rx_dmamux_channel;
+	io->rx_dma_request = rx_request;
+	io->tx_dma_channel = tx_channel;
+	io->tx_dmamux_channel = tx_dmamux_channel;
+	io->tx_dma_request = tx_request;
+}
+
+void modbus_io_init(
+	modbus_io_t *io,
+	UART_HandleTypeDef* _modbus_io_huart, uint32_t modbus_io_huart_freq, TIM_HandleTypeDef* _modbus_io_htim, uint32_t modbus_io_tim_freq,
+	uint8_t de_assertion_bits, uint8_t de_deassertion_bits, uint16_t min_reply_bits, uint16_t max_reply_bits
+) {
+	io->frame_new = true;
+	io->frame_end = true;
+	io->reply_window_open = true;
+	io->turnarounds.min = UINT32_MAX;
+	io->tentative_frame = MODBUS_IO_NO_FRAME;
+	io->receive_buffer = io->frames[0].data;
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+	if(io->rx_dma_channel == NULL) {
+		io->rx_dma_channel = MODBUS_IO_RX_DMA_CHANNEL;
+		io->rx_dmamux_channel = MODBUS_IO_RX_DMAMUX_CHANNEL;
+		io->rx_dma_request = MODBUS_IO_RX_DMA_REQUEST;
+	}
+#endif
+#if MODBUS_IO_TX_MODE == MODBUS_IO_TX_DMA
+	if(io->tx_dma_channel == NULL) {
+		io->tx_dma_channel = MODBUS_IO_TX_DMA_CHANNEL;
+		io->tx_dmamux_channel = MODBUS_IO_TX_DMAMUX_CHANNEL;
+		io->tx_dma_request = MODBUS_IO_TX_DMA_REQUEST;
+	}
+#endif
+
+	io->huart = _modbus_io_huart;
+
+	switch(io->huart->Init.ClockPrescaler) {
 		case UART_PRESCALER_DIV1: 	modbus_io_huart_freq /= 1; break;
 		case UART_PRESCALER_DIV2: 	modbus_io_huart_freq /= 2; break;
 		case UART_PRESCALER_DIV4: 	modbus_io_huart_freq /= 4; break;
@@ -36,132 +127,745 @@ void modbus_io_init(UART_HandleTypeDef* _modbus_io_huart, uint32_t modbus_io_hua
 	}
 
 	__HAL_UART_DISABLE_IT(_modbus_io_huart, UART_IT_TC);
-	__HAL_UART_ENABLE_IT(_modbus_io_huart, UART_IT_RXNE);
 
-	modbus_io_htim = _modbus_io_htim;
+	io->htim = _modbus_io_htim;
+	io->counter_max = IS_TIM_32B_COUNTER_INSTANCE(_modbus_io_htim->Instance) ? UINT32_MAX : UINT16_MAX;
+
+	io->huart_kernel_freq = modbus_io_huart_freq;
+	io->tim_kernel_freq = modbus_io_tim_freq;
+	io->min_reply_bits = min_reply_bits;
+	io->max_reply_bits = max_reply_bits;
 
-	modbus_io_htim->Instance->PSC = ((float)modbus_io_tim_freq / modbus_io_huart_freq) * modbus_io_huart->Instance->BRR - 1;
+	configure_timing(io);
 
-	float bits_per_frame = 1 + (modbus_io_huart->Init.Parity > 0);
-	switch(modbus_io_huart->Init.WordLength) {
-		case UART_WORDLENGTH_7B: bits_per_frame += 7; break;
-		case UART_WORDLENGTH_8B: bits_per_frame += 8; break;
-		case UART_WORDLENGTH_9B: bits_per_frame += 9; break;
+	__HAL_TIM_ENABLE_IT(_modbus_io_htim, TIM_IT_CC1);
+	__HAL_TIM_ENABLE_IT(_modbus_io_htim, TIM_IT_CC2);
+
+	if(min_reply_bits > 0) {
+		io->reply_window_open = false;
+		__HAL_TIM_ENABLE_IT(_modbus_io_htim, TIM_IT_CC3);
 	}
-	switch(modbus_io_huart->Init.StopBits) {
-		case UART_STOPBITS_0_5: bits_per_frame += 0.5f; break;
-		case UART_STOPBITS_1: 	bits_per_frame += 1; break;
-		case UART_STOPBITS_1_5: bits_per_frame += 1.5f; break;
-		case UART_STOPBITS_2:	bits_per_frame += 2; break;
+	if(max_reply_bits > 0)
+		__HAL_TIM_ENABLE_IT(_modbus_io_htim, TIM_IT_CC4);
+
+	io->huart->Instance->CR1 &= ~USART_CR1_UE;	// Most of CR1, CR2 & CR3 is write protected while USART is enabled
+
+	// Driver enable times are counted in sample times, 1/16 or 1/8 of a bit depending on oversampling
+	uint32_t samples_per_bit = (io->huart->Instance->CR1 & USART_CR1_OVER8) ? 8 : 16;
+	uint32_t de_assertion_samples = de_assertion_bits * samples_per_bit, de_deassertion_samples = de_deassertion_bits * samples_per_bit;
+	if(de_assertion_samples > (USART_CR1_DEAT_Msk >> USART_CR1_DEAT_Pos))
+		de_assertion_samples = USART_CR1_DEAT_Msk >> USART_CR1_DEAT_Pos;
+	if(de_deassertion_samples > (USART_CR1_DEDT_Msk >> USART_CR1_DEDT_Pos))
+		de_deassertion_samples = USART_CR1_DEDT_Msk >> USART_CR1_DEDT_Pos;
+
+	io->huart->Instance->CR1 = (io->huart->Instance->CR1 & ~(USART_CR1_DEAT | USART_CR1_DEDT)) |
+								(de_assertion_samples << USART_CR1_DEAT_Pos) | (de_deassertion_samples << USART_CR1_DEDT_Pos);
+
+	io->de_assertion_bits = (de_assertion_samples + samples_per_bit - 1) / samples_per_bit;
+
+#if (MODBUS_IO_RX_MODE == MODBUS_IO_RX_FIFO) || (MODBUS_IO_TX_MODE == MODBUS_IO_TX_FIFO)
+	io->huart->Instance->CR3 = (io->huart->Instance->CR3 & ~(USART_CR3_RXFTCFG | USART_CR3_TXFTCFG)) |
+								MODBUS_IO_RX_FIFO_THRESHOLD | MODBUS_IO_TX_FIFO_THRESHOLD;
+	io->huart->Instance->CR1 |= USART_CR1_FIFOEN;
+#endif
+
+#if (MODBUS_IO_RX_MODE != MODBUS_IO_RX_TIMER) || MODBUS_IO_MUTE_FOREIGN_FRAMES
+	// Timer still paces transmission, end of received frames is left to the receiver timeout. RX_TIMER only hands it muted frames
+	io->huart->Instance->CR2 |= USART_CR2_RTOEN;
+#endif
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+	__HAL_RCC_DMA1_CLK_ENABLE();
+
+	io->rx_dmamux_channel->CCR = io->rx_dma_request;
+
+	io->rx_dma_channel->CCR = 0;
+	io->rx_dma_channel->CPAR = (uint32_t)&io->huart->Instance->RDR;
+	io->rx_dma_channel->CMAR = (uint32_t)io->receive_buffer;
+	io->rx_dma_channel->CNDTR = MODBUS_IO_BUFFER_SIZE;
+	io->rx_dma_channel->CCR = DMA_CCR_MINC | DMA_CCR_EN;	// Byte to byte, peripheral to memory, no interrupts
+
+	io->huart->Instance->CR3 |= USART_CR3_DMAR;
+#endif
+
+	io->huart->Instance->CR1 |= USART_CR1_UE;
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_TIMER
+	__HAL_UART_ENABLE_IT(io->huart, UART_IT_RXNE);
+#else
+	__HAL_UART_CLEAR_FLAG(io->huart, UART_CLEAR_RTOF);
+	__HAL_UART_ENABLE_IT(io->huart, UART_IT_RTO);
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_FIFO
+	__HAL_UART_ENABLE_IT(io->huart, UART_IT_RXFT);
+#endif
+#endif
+
+#if MODBUS_IO_TX_MODE == MODBUS_IO_TX_DMA
+	__HAL_RCC_DMA1_CLK_ENABLE();
+
+	io->tx_dmamux_channel->CCR = io->tx_dma_request;
+
+	io->tx_dma_channel->CCR = DMA_CCR_MINC | DMA_CCR_DIR;	// Byte to byte, memory to peripheral, no interrupts, enabled per write
+	io->tx_dma_channel->CPAR = (uint32_t)&io->huart->Instance->TDR;
+
+	io->huart->Instance->CR3 |= USART_CR3_DMAT;
+#endif
+}
+
+void signal_ready(modbus_io_t *io) {
+	io->ready = true;
+
+#if MODBUS_IO_PENDSV
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+#endif
+}
+
+void restart_timer(modbus_io_t *io) {
+	io->htim->Instance->CR1 &= ~TIM_CR1_CEN;
+
+	io->frame_new = false;
+	io->frame_end = false;
+
+	io->reply_window_open = (io->htim->Instance->DIER & TIM_DIER_CC3IE) == 0;
+	io->reply_window_closed = false;
+
+	io->htim->Instance->CNT = 0;
+	io->htim->Instance->CR1 |= TIM_CR1_CEN;
+}
+
+void apply_pending_format(modbus_io_t *io) {	// Call only from ISR at a frame boundary
+	io->huart->Instance->CR1 &= ~USART_CR1_UE;	// Format, BRR & ABREN are write protected while USART is enabled
+
+	if(io->pending_baud == 0) {	// Auto-baud, old rate stays until next frame's first byte is measured
+		io->auto_baud_fallback = io->huart->Instance->BRR;
+		io->huart->Instance->CR2 = (io->huart->Instance->CR2 & ~USART_CR2_ABRMODE) | USART_CR2_ABREN;	// Mode 0, measures start bit
+	}
+	else {
+		uint32_t freq = io->huart_kernel_freq;
+		if(io->huart->Instance->CR1 & USART_CR1_OVER8) {
+			uint32_t divider = (2 * freq + io->pending_baud / 2) / io->pending_baud;
+			io->huart->Instance->BRR = (divider & ~0xFU) | ((divider & 0xFU) >> 1);
+		}
+		else
+			io->huart->Instance->BRR = (freq + io->pending_baud / 2) / io->pending_baud;
+
+		io->huart->Instance->CR2 &= ~USART_CR2_ABREN;	// Set rate ends any auto-baud still going
 	}
 
-	modbus_io_htim->Instance->CCR1 = bits_per_frame * 3/2;	// 1.5 character times
-	modbus_io_htim->Instance->CCR2 = bits_per_frame * 7/2;	// 3.5 character times
-	modbus_io_htim->Instance->ARR = bits_per_frame * 7/2; 	// Just needs to be >= CCR2, stops earlier too
+	io->auto_baud_pending = io->pending_baud == 0;
+	io->auto_baud_measured = false;
 
-	__HAL_TIM_ENABLE_IT(_modbus_io_htim, TIM_IT_CC1);
-	__HAL_TIM_ENABLE_IT(_modbus_io_htim, TIM_IT_CC2);
+	// RTU characters are always 8 data bits, parity bit is counted in word length
+	io->huart->Init.WordLength = (io->pending_parity == UART_PARITY_NONE) ? UART_WORDLENGTH_8B : UART_WORDLENGTH_9B;
+	io->huart->Init.Parity = io->pending_parity;
+	io->huart->Init.StopBits = io->pending_stop_bits;
+
+	io->huart->Instance->CR1 = (io->huart->Instance->CR1 & ~(USART_CR1_M | USART_CR1_PCE | USART_CR1_PS)) |
+								io->huart->Init.WordLength | io->huart->Init.Parity;
+	io->huart->Instance->CR2 = (io->huart->Instance->CR2 & ~USART_CR2_STOP) | io->huart->Init.StopBits;
 
-	modbus_io_htim->Instance->EGR |= TIM_EGR_UG; // Update registers to configured values
-	modbus_io_htim->Instance->SR &= ~TIM_SR_UIF; // Necessary after update generation
+	io->huart->Instance->RQR = USART_RQR_RXFRQ;	// Anything half received belongs to old format
+	io->huart->Instance->CR1 |= USART_CR1_UE;
+
+	if(io->auto_baud_pending)
+		io->huart->Instance->RQR = USART_RQR_ABRRQ;
+
+	configure_timing(io);
+
+	io->format_pending = false;
+}
+
+void request_format(modbus_io_t *io, uint32_t baud_rate, uint32_t parity, uint32_t stop_bits) {	// Baud rate 0 measures it
+	io->pending_baud = baud_rate;
+	io->pending_parity = parity;
+	io->pending_stop_bits = stop_bits;
+
+	io->format_pending = true;	// Set last, ISR may pick it up from here on
+
+	if(io->frame_end && !modbus_io_write_busy(io))	// Line is idle, no boundary is coming so make one
+		io->htim->Instance->EGR = TIM_EGR_CC2G;
+}
+
+void modbus_io_reconfigure(modbus_io_t *io, uint32_t baud_rate, uint32_t parity, uint32_t stop_bits) {
+	if(baud_rate == 0)
+		return;
+
+	request_format(io, baud_rate, parity, stop_bits);
+}
+
+void modbus_io_auto_baud(modbus_io_t *io) {	// Same frame boundary as a reconfiguration, so a reply or frame in flight isn't cut off
+	request_format(io, 0, io->huart->Init.Parity, io->huart->Init.StopBits);
+}
+
+bool standard_baud(uint32_t baud) {	// Within 3% of a rate masters actually use
+	static const uint32_t rates[] = {1200, 2400, 4800, 9600, 14400, 19200, 38400, 57600, 115200, 230400, 460800, 921600};
+
+	for(uint8_t i = 0; i < (sizeof(rates) / sizeof(rates[0])); ++i)
+		if((baud * 100 >= rates[i] * 97) && (baud * 100 <= rates[i] * 103))
+			return true;
+
+	return false;
+}
+
+bool auto_baud_plausible(modbus_io_t *io) {	// Mode 0 measures up to first rising edge, so an even first byte comes out at half rate or less
+	return !__HAL_UART_GET_FLAG(io->huart, UART_FLAG_ABRE) && standard_baud(actual_baud(io));
+}
+
+void check_auto_baud(modbus_io_t *io) {	// Picks up rate measured by hardware on first byte of frame, confirm_auto_baud() decides at frame end whether it stays
+	if(!io->auto_baud_pending || io->auto_baud_measured || !__HAL_UART_GET_FLAG(io->huart, UART_FLAG_ABRF))
+		return;
+
+	io->auto_baud_measured = true;
+
+	if(auto_baud_plausible(io))
+		configure_timing(io);
+}
+
+bool frame_intact(modbus_io_t *io) {	// Whole frame stored and its CRC checks out, whichever unit ID it's for
+	if(io->frame_poisoned || (io->receive_size < 4) || (io->receive_size >= MODBUS_IO_BUFFER_SIZE))	// Address, function & CRC at least
+		return false;
+
+#if MODBUS_IO_RX_CRC && (MODBUS_IO_RX_MODE != MODBUS_IO_RX_DMA)
+	return io->receive_crc == 0;
+#else
+	return modbus_crc_software((const uint8_t*)io->receive_buffer, io->receive_size) == 0;	// Only on frames confirming a measured rate
+#endif
+}
+
+void confirm_auto_baud(modbus_io_t *io) {	// At frame end. Measured rate only stays if the frame it was measured on came through intact
+	if(!io->auto_baud_measured)
+		return;
+
+	io->auto_baud_measured = false;
+
+	if(auto_baud_plausible(io) && frame_intact(io)) {
+		io->auto_baud_pending = false;
+		return;
+	}
+
+	// Line is idle, go back to old rate and measure next frame
+	io->huart->Instance->CR1 &= ~USART_CR1_UE;	// BRR is write protected while USART is enabled
+	io->huart->Instance->BRR = io->auto_baud_fallback;
+	io->huart->Instance->CR1 |= USART_CR1_UE;
+
+	configure_timing(io);
+
+	io->huart->Instance->RQR = USART_RQR_ABRRQ;
+}
+
+void record_turnaround(modbus_io_t *io) {	// First start bit goes out after driver enable assertion time
+	uint32_t elapsed = io->htim->Instance->CNT, ccr2 = io->htim->Instance->CCR2;
+
+	if(elapsed < ccr2)	// Timer restarted by something other than a request
+		return;
+
+	elapsed = elapsed - ccr2 + io->de_assertion_bits;
+
+	io->turnarounds.last = elapsed;
+	if(elapsed < io->turnarounds.min)
+		io->turnarounds.min = elapsed;
+	if(elapsed > io->turnarounds.max)
+		io->turnarounds.max = elapsed;
+}
+
+void cancel_transmit(modbus_io_t *io) {	// Only before transmission has started
+#if MODBUS_IO_TX_MODE == MODBUS_IO_TX_DMA
+	io->transmit_data = NULL;
+#else
+	io->transmit_head = 0;
+#endif
+	io->transmit_size = 0;
+}
+
+void drop_transmit(modbus_io_t *io) {
+	cancel_transmit(io);
+
+	++io->turnarounds.late;
 }
 
-void restart_timer(void) {
-	modbus_io_htim->Instance->CR1 &= ~TIM_CR1_CEN;
+void start_transmit(modbus_io_t *io) {
+	if(io->transmit_started)
+		return;
+
+	io->transmit_started = true;
+
+	record_turnaround(io);
+
+#if MODBUS_IO_TX_MODE == MODBUS_IO_TX_DMA
+	io->tx_dma_channel->CMAR = (uint32_t)io->transmit_data;
+	io->tx_dma_channel->CNDTR = io->transmit_size;
 
-	frame_new = false;
-	frame_end = false;
+	__HAL_UART_CLEAR_FLAG(io->huart, UART_CLEAR_TCF);	// TC is only set again once the last byte has left the shift register
+	__HAL_UART_ENABLE_IT(io->huart, UART_IT_TC);
 
-	modbus_io_htim->Instance->CNT = 0;
-	modbus_io_htim->Instance->CR1 |= TIM_CR1_CEN;
+	io->tx_dma_channel->CCR |= DMA_CCR_EN;
+#elif MODBUS_IO_TX_MODE == MODBUS_IO_TX_FIFO
+	__HAL_UART_ENABLE_IT(io->huart, UART_IT_TXFT);
+#else
+	__HAL_UART_ENABLE_IT(io->huart, UART_IT_TC);
+#endif
 }
 
-uint16_t modbus_io_write(uint8_t *data, uint16_t len) {
-	if(len == 0)
+uint16_t modbus_io_write(modbus_io_t *io, uint8_t *data, uint16_t len) {
+	if(len == 0 || modbus_io_write_busy(io))
 		return 0;
 	else if(len >= MODBUS_IO_BUFFER_SIZE)
 		len = MODBUS_IO_BUFFER_SIZE;
 
-	memcpy((void*)modbus_io_transmit_buffer, (void*)data, len);
+#if MODBUS_IO_TX_MODE == MODBUS_IO_TX_DMA
+	io->transmit_data = data;
+#else
+	memcpy((void*)io->transmit_buffer, (void*)data, len);
+
+	io->transmit_head = 0;
+#endif
+	io->transmit_size = len;
+
+	uint8_t tail = io->frames_tail;
+	if(tail != io->frames_head) {	// Replying to a borrowed frame
+		io->reply_tentative = (tail == io->tentative_frame);
+
+		if(io->frames[tail].size == 0) {	// Withdrawn while reply was being built
+			cancel_transmit(io);
 
-	modbus_io_transmit_head = 0;
-	modbus_io_transmit_size = len;
+			return 0;
+		}
+	}
+
+	if(io->reply_window_closed) {
+		drop_transmit(io);
 
-	if(frame_end)
-		__HAL_UART_ENABLE_IT(modbus_io_huart, UART_IT_TC);
+		return 0;
+	}
+
+	if(io->frame_end && io->reply_window_open)
+		start_transmit(io);
 
 	return len;
 }
 
-void modbus_io_tc_handler(void) {
-	restart_timer();
+bool modbus_io_write_busy(modbus_io_t *io) {
+	return io->transmit_size > 0;
+}
+
+void modbus_io_tx_ft_handler(modbus_io_t *io) {	// Tops FIFO back up, TC takes over once everything is queued
+#if MODBUS_IO_TX_MODE == MODBUS_IO_TX_FIFO
+	restart_timer(io);
 
-	modbus_io_huart->Instance->TDR = modbus_io_transmit_buffer[modbus_io_transmit_head++];
+	while((io->transmit_head < io->transmit_size) && __HAL_UART_GET_FLAG(io->huart, UART_FLAG_TXFNF))
+		io->huart->Instance->TDR = io->transmit_buffer[io->transmit_head++];
 
-	if(modbus_io_transmit_head == modbus_io_transmit_size) {
-		modbus_io_transmit_size = 0;
-		modbus_io_transmit_head = 0;
+	if(io->transmit_head == io->transmit_size) {
+		__HAL_UART_DISABLE_IT(io->huart, UART_IT_TXFT);
+		__HAL_UART_ENABLE_IT(io->huart, UART_IT_TC);
+	}
+#endif
+}
+
+void modbus_io_tc_handler(modbus_io_t *io) {
+	restart_timer(io);
+
+#if MODBUS_IO_TX_MODE == MODBUS_IO_TX_DMA
+	io->tx_dma_channel->CCR &= ~DMA_CCR_EN;	// Whole buffer has been sent, hand it back
+
+	io->transmit_size = 0;
+	io->transmit_data = NULL;
+	io->transmit_started = false;
+	signal_ready(io);
+
+	__HAL_UART_DISABLE_IT(io->huart, UART_IT_TC);
+#elif MODBUS_IO_TX_MODE == MODBUS_IO_TX_FIFO
+	io->transmit_size = 0;	// Last burst has left the shift register
+	io->transmit_head = 0;
+	io->transmit_started = false;
+	signal_ready(io);
+
+	__HAL_UART_DISABLE_IT(io->huart, UART_IT_TC);
+#else
+	io->huart->Instance->TDR = io->transmit_buffer[io->transmit_head++];
+
+	if(io->transmit_head == io->transmit_size) {
+		io->transmit_size = 0;
+		io->transmit_head = 0;
+		io->transmit_started = false;
+		signal_ready(io);
 
-		__HAL_UART_DISABLE_IT(modbus_io_huart, UART_IT_TC);
+		__HAL_UART_DISABLE_IT(io->huart, UART_IT_TC);
 	}
+#endif
 }
 
-uint16_t modbus_io_read(uint8_t *buffer) {
-	if(modbus_io_read_size == 0)
+uint8_t next_frame(uint8_t index) {
+	return (index == MODBUS_IO_QUEUE_DEPTH) ? 0 : index + 1;
+}
+
+uint16_t modbus_io_borrow(modbus_io_t *io, uint8_t **frame) {
+	uint8_t tail = io->frames_tail;
+
+	while((tail != io->frames_head) && (io->frames[tail].size == 0))	// Withdrawn
+		tail = io->frames_tail = next_frame(tail);
+
+	if(tail == io->frames_head)
 		return 0;
 
-	memcpy((void*)buffer, (void*)modbus_io_read_buffer, modbus_io_read_size);
+	__DMB();	// Slot is only read after seeing head published past it
+
+	*frame = (uint8_t*)io->frames[tail].data;
+
+	return io->frames[tail].size;
+}
 
-	uint16_t count = modbus_io_read_size;
+void modbus_io_return(modbus_io_t *io, uint8_t *frame) {
+	uint8_t tail = io->frames_tail;
+
+	if((tail != io->frames_head) && (frame == io->frames[tail].data)) {
+		__DMB();	// Borrowed frame is read through a non volatile pointer, finish with it before ISR can refill it
+
+		io->frames_tail = next_frame(tail);	// Hands slot back to ISR
+	}
+}
+
+bool modbus_io_tentative(modbus_io_t *io) {
+	return io->frames_tail == io->tentative_frame;
+}
+
+bool modbus_io_crc_valid(modbus_io_t *io) {
+	uint8_t tail = io->frames_tail;
+
+	if((tail == io->frames_head) || !io->frames[tail].crc_valid)
+		return false;
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+	return modbus_crc((const uint8_t*)io->frames[tail].data, io->frames[tail].size) == 0;	// DMA stored bytes without the CPU, checked here so RTO interrupt stays short
+#else
+	return true;
+#endif
+}
+
+bool modbus_io_ready(modbus_io_t *io) {
+	if(!io->ready)
+		return false;
+
+	io->ready = false;
+
+	return true;
+}
 
-	modbus_io_read_size = 0;
+uint8_t modbus_io_queue_depth(modbus_io_t *io) {
+	uint8_t head = io->frames_head, tail = io->frames_tail;
+
+	return (head >= tail) ? head - tail : head + MODBUS_IO_QUEUE_DEPTH + 1 - tail;
+}
+
+uint32_t modbus_io_queue_overflows(modbus_io_t *io) {
+	return io->frames_overflows;
+}
+
+uint16_t modbus_io_read(modbus_io_t *io, uint8_t *buffer) {
+	uint8_t *frame;
+	uint16_t count = modbus_io_borrow(io, &frame);
+
+	if(count == 0)
+		return 0;
+
+	memcpy((void*)buffer, (void*)frame, count);
+
+	modbus_io_return(io, frame);
 
 	return count;
 }
 
-void modbus_io_rx_ne_handler(void) {
-	if(frame_new)
-		modbus_io_receive_size = 0;
+void modbus_io_filter_address(modbus_io_t *io, uint8_t address) {
+	io->addresses[address >> 3] |= 1 << (address & 0x07);
+
+	io->address_filter = true;
+
+#if MODBUS_IO_MUTE_FOREIGN_FRAMES && (MODBUS_IO_RX_MODE != MODBUS_IO_RX_DMA)
+	io->huart->Instance->CR1 &= ~USART_CR1_UE;	// MME & WAKE are write protected while USART is enabled
+	io->huart->Instance->CR1 = (io->huart->Instance->CR1 & ~USART_CR1_WAKE) | USART_CR1_MME;	// Wake up on idle line
+	io->huart->Instance->CR1 |= USART_CR1_UE;
+#endif
+}
+
+bool address_accepted(modbus_io_t *io, uint8_t address) {
+	return !io->address_filter || (address == 0) || (io->addresses[address >> 3] & (1 << (address & 0x07)));
+}
+
+void check_line_errors(modbus_io_t *io) {	// Error flags belong to the byte about to be read from RDR
+	uint32_t isr = io->huart->Instance->ISR;
+
+	if(!(isr & (USART_ISR_PE | USART_ISR_FE | USART_ISR_NE | USART_ISR_ORE)))
+		return;
 
-	restart_timer();
+	if(isr & USART_ISR_ORE)
+		++io->lines.character_overruns;
 
-	uint8_t rdr = modbus_io_huart->Instance->RDR;
-	if(modbus_io_receive_size < MODBUS_IO_BUFFER_SIZE)
-		modbus_io_receive_buffer[modbus_io_receive_size++] = rdr;
+	io->frame_poisoned = true;
+
+	__HAL_UART_CLEAR_FLAG(io->huart, UART_CLEAR_PEF | UART_CLEAR_FEF | UART_CLEAR_NEF | UART_CLEAR_OREF);
+}
 
-	if(
-		__HAL_UART_GET_FLAG(modbus_io_huart, UART_FLAG_PE) ||
-		__HAL_UART_GET_FLAG(modbus_io_huart, UART_FLAG_FE) ||
-		__HAL_UART_GET_FLAG(modbus_io_huart, UART_FLAG_NE)
-	) {
-		__HAL_UART_CLEAR_FLAG(modbus_io_huart, UART_FLAG_PE);
-		__HAL_UART_CLEAR_FLAG(modbus_io_huart, UART_FLAG_FE);
-		__HAL_UART_CLEAR_FLAG(modbus_io_huart, UART_FLAG_NE);
+void receive_byte(modbus_io_t *io, uint8_t byte) {	// Only first byte of a frame is looked at, frames for other devices are never queued
+	if(io->frame_poisoned || (io->frame_foreign && !io->auto_baud_pending))
+		return;
+
+	if((io->receive_size == 0) && !address_accepted(io, byte)) {
+		io->frame_foreign = true;
+
+		if(!io->auto_baud_pending) {	// Otherwise stored & checked all the same, any intact frame on the bus may confirm a measured rate
+#if MODBUS_IO_MUTE_FOREIGN_FRAMES
+			io->huart->Instance->RQR = USART_RQR_MMRQ;	// No more interrupts until line goes idle
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_TIMER
+			io->htim->Instance->CR1 &= ~TIM_CR1_CEN;	// Muted bytes can't restart timer, so receiver timeout ends frame instead
+			__HAL_UART_CLEAR_FLAG(io->huart, UART_CLEAR_RTOF);
+			__HAL_UART_ENABLE_IT(io->huart, UART_IT_RTO);
+#endif
+#endif
+			return;
+		}
 	}
 
-    if(__HAL_UART_GET_FLAG(modbus_io_huart, UART_FLAG_ORE))
-        __HAL_UART_CLEAR_FLAG(modbus_io_huart, UART_FLAG_ORE);
+#if MODBUS_IO_RX_CRC
+	if(io->receive_size == 0)
+		io->receive_crc = 0xFFFF;
+
+	io->receive_crc = MODBUS_CRC_UPDATE(io->receive_crc, byte);
+#endif
+
+	if(io->receive_size < MODBUS_IO_BUFFER_SIZE)
+		io->receive_buffer[io->receive_size++] = byte;
 }
 
-void modbus_io_1_5_char_handler(void) {
-	frame_new = true;
+void withdraw_tentative(modbus_io_t *io) {	// Line woke between 1.5 & 3.5 character times, so tentative frame was never a complete one
+	uint8_t frame = io->tentative_frame;
+
+	if(frame == MODBUS_IO_NO_FRAME)
+		return;
 
-	__HAL_TIM_CLEAR_FLAG(modbus_io_htim, TIM_FLAG_CC1);
+	io->tentative_frame = MODBUS_IO_NO_FRAME;
+	io->frames[frame].size = 0;
+
+	if(io->reply_tentative && !io->transmit_started)
+		cancel_transmit(io);
+
+	io->reply_tentative = false;
 }
 
-void modbus_io_3_5_char_handler(void) {
-	frame_end = true;
+void modbus_io_rx_ne_handler(modbus_io_t *io) {
+	if(io->frame_new) {
+#if MODBUS_IO_SPECULATIVE
+		if(!io->frame_end)
+			withdraw_tentative(io);
+#endif
 
-	if(modbus_io_transmit_size > 0)							// Shouldn't ever happen since device should wait for frame end, process message, then reply
-		__HAL_UART_ENABLE_IT(modbus_io_huart, UART_IT_TC);
+		io->receive_size = 0;
+		io->frame_foreign = false;
+		io->frame_poisoned = false;
+
+		check_auto_baud(io);
+	}
 
-	if(modbus_io_receive_size > 0) {						// Separate read buffer is used just in case application takes a while to read, avoids race conditions
-		memcpy((void*)modbus_io_read_buffer, (void*)modbus_io_receive_buffer, modbus_io_receive_size);
+	restart_timer(io);
 
-		modbus_io_read_size = modbus_io_receive_size;
+	check_line_errors(io);
 
-		modbus_io_receive_size = 0;
+	receive_byte(io, io->huart->Instance->RDR);
+}
+
+void publish_frame(modbus_io_t *io) {	// Queues filled receive slot and moves on to the next free one. If queue is full, the new frame is dropped
+	confirm_auto_baud(io);
+
+	if((io->receive_size > 0) || io->frame_foreign || io->frame_poisoned)
+		++io->lines.bus_messages;
+
+	if(io->frame_poisoned)
+		++io->lines.line_errors;
+	else if(!io->frame_foreign && (io->receive_size > 0)) {
+		uint8_t head = io->frames_head, next = next_frame(head);
+
+		if(next == io->frames_tail)
+			++io->frames_overflows;
+		else {
+			io->frames[head].size = io->receive_size;
+#if MODBUS_IO_RX_CRC && (MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA)
+			io->frames[head].crc_valid = io->receive_size < MODBUS_IO_BUFFER_SIZE;	// Overlong frame lost bytes, CRC itself is left to modbus_io_crc_valid()
+#elif MODBUS_IO_RX_CRC
+			io->frames[head].crc_valid = (io->receive_size < MODBUS_IO_BUFFER_SIZE) && (io->receive_crc == 0);	// Overlong frame lost bytes
+#endif
+			__DMB();	// Data & descriptor land before head, DMA written bytes included
+
+			io->frames_head = next;	// Publish last, application may take slot from here on
+			signal_ready(io);
+
+			io->receive_buffer = io->frames[next].data;
+		}
 	}
 
-	__HAL_TIM_CLEAR_FLAG(modbus_io_htim, TIM_FLAG_CC2);
+	io->receive_size = 0;
+	io->frame_foreign = false;
+	io->frame_poisoned = false;
+}
+
+void drain_rx_fifo(modbus_io_t *io) {	// With FIFO enabled, error flags follow whichever byte is at the front
+	check_line_errors(io);
+
+	while(__HAL_UART_GET_FLAG(io->huart, UART_FLAG_RXFNE)) {
+		receive_byte(io, io->huart->Instance->RDR);
+
+		check_line_errors(io);
+	}
+}
+
+void modbus_io_rx_ft_handler(modbus_io_t *io) {
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_FIFO
+	io->frame_end = false;
+
+	drain_rx_fifo(io);
+#endif
+}
+
+void modbus_io_1_5_char_handler(modbus_io_t *io) {
+	io->frame_new = true;
+
+#if MODBUS_IO_SPECULATIVE
+	uint8_t head = io->frames_head;
+
+	publish_frame(io);
+
+	if(io->frames_head != head)	// Wasn't dropped for a full queue
+		io->tentative_frame = head;
+#endif
+
+	__HAL_TIM_CLEAR_FLAG(io->htim, TIM_FLAG_CC1);
+}
+
+void open_reply_window(modbus_io_t *io) {	// Request's 3.5 character time has just elapsed
+	if(io->reply_window_open && (io->transmit_size > 0))	// Shouldn't ever happen without a minimum reply delay since device should wait for frame end, process message, then reply
+		start_transmit(io);
+}
+
+void modbus_io_3_5_char_handler(modbus_io_t *io) {
+	__HAL_TIM_CLEAR_FLAG(io->htim, TIM_FLAG_CC2);
+
+	if((io->htim->Instance->CR1 & TIM_CR1_CEN) && (io->htim->Instance->CNT < io->htim->Instance->CCR2))
+		return;	// Generated by modbus_io_reconfigure(io) just as a frame started
+
+	io->frame_end = true;
+
+	if(io->tentative_frame != MODBUS_IO_NO_FRAME) {	// Line stayed idle, frame is confirmed
+		io->tentative_frame = MODBUS_IO_NO_FRAME;
+		signal_ready(io);
+	}
+	io->reply_tentative = false;
+
+	open_reply_window(io);
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_TIMER
+	publish_frame(io);
+#endif
+
+	if(io->format_pending && !modbus_io_write_busy(io))
+		apply_pending_format(io);
+}
+
+void modbus_io_rto_handler(modbus_io_t *io) {	// Line has been idle for 3.5 character times, publish whatever arrived
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+	io->rx_dma_channel->CCR &= ~DMA_CCR_EN;
+
+	io->receive_size = MODBUS_IO_BUFFER_SIZE - io->rx_dma_channel->CNDTR;
+	bool overflowed = io->receive_size == MODBUS_IO_BUFFER_SIZE;
+
+	if((io->receive_size > 0) && !address_accepted(io, io->receive_buffer[0]))	// Unit ID
+		io->frame_foreign = true;	// DMA has already stored it, but it needn't be queued
+
+	check_line_errors(io);	// Any error since DMA was armed belongs to this frame
+#elif MODBUS_IO_RX_MODE == MODBUS_IO_RX_FIFO
+	drain_rx_fifo(io);	// Tail of frame that didn't reach threshold
+#endif
+
+	check_auto_baud(io);
+
+	io->frame_new = true;
+	io->frame_end = true;
+
+	// Receiving doesn't run the timer, pick it up as if CC2 had just fired so reply delays and turnaround are measured from here
+	io->htim->Instance->CR1 &= ~TIM_CR1_CEN;
+
+	io->reply_window_open = (io->htim->Instance->DIER & TIM_DIER_CC3IE) == 0;
+	io->reply_window_closed = false;
+
+	io->htim->Instance->CNT = io->htim->Instance->CCR2 + 1;
+	io->htim->Instance->CR1 |= TIM_CR1_CEN;
+
+	open_reply_window(io);
+
+	publish_frame(io);
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+	if(overflowed)	// Frame longer than buffer left a byte stalled in RDR. Otherwise RDR may already hold next frame's first byte, DMA picks it up once enabled
+		io->huart->Instance->RQR = USART_RQR_RXFRQ;
+
+	io->rx_dma_channel->CMAR = (uint32_t)io->receive_buffer;	// May have been swapped
+	io->rx_dma_channel->CNDTR = MODBUS_IO_BUFFER_SIZE;
+	io->rx_dma_channel->CCR |= DMA_CCR_EN;
+#endif
+
+	__HAL_UART_CLEAR_FLAG(io->huart, UART_CLEAR_RTOF);
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_TIMER
+	__HAL_UART_DISABLE_IT(io->huart, UART_IT_RTO);	// Muted frame is over, timer takes frames back
+#endif
+
+	if(io->format_pending && !modbus_io_write_busy(io))
+		apply_pending_format(io);
+}
+
+void modbus_io_min_reply_handler(modbus_io_t *io) {
+	io->reply_window_open = true;
+
+	if(io->frame_end && (io->transmit_size > 0))
+		start_transmit(io);
+
+	__HAL_TIM_CLEAR_FLAG(io->htim, TIM_FLAG_CC3);
+}
+
+void modbus_io_max_reply_handler(modbus_io_t *io) {	// Master has likely given up on reply by now, don't collide with its retry
+	io->reply_window_closed = true;
+
+	if((io->transmit_size > 0) && !io->transmit_started)
+		drop_transmit(io);
+
+	__HAL_TIM_CLEAR_FLAG(io->htim, TIM_FLAG_CC4);
+}
+
+void modbus_io_turnaround(modbus_io_t *io, modbus_io_turnaround_stats *stats) {
+	*stats = io->turnarounds;
+}
+
+void modbus_io_line(modbus_io_t *io, modbus_io_line_stats *stats) {
+	*stats = io->lines;
+}
+
+void modbus_io_usart_irq_handler(modbus_io_t *io) {
+	if(__HAL_UART_GET_FLAG(io->huart, UART_FLAG_TC) && io->huart->Instance->CR1 & USART_CR1_TCIE)
+		modbus_io_tc_handler(io);
+	if(__HAL_UART_GET_FLAG(io->huart, UART_FLAG_RXNE) && io->huart->Instance->CR1 & USART_CR1_RXNEIE_RXFNEIE)
+		modbus_io_rx_ne_handler(io);
+	if(__HAL_UART_GET_FLAG(io->huart, UART_FLAG_TXFT) && io->huart->Instance->CR3 & USART_CR3_TXFTIE)
+		modbus_io_tx_ft_handler(io);
+	if(__HAL_UART_GET_FLAG(io->huart, UART_FLAG_RXFT) && io->huart->Instance->CR3 & USART_CR3_RXFTIE)
+		modbus_io_rx_ft_handler(io);
+	if(__HAL_UART_GET_FLAG(io->huart, UART_FLAG_RTOF) && io->huart->Instance->CR1 & USART_CR1_RTOIE)
+		modbus_io_rto_handler(io);
+}
+
+void modbus_io_tim_irq_handler(modbus_io_t *io) {
+	if(__HAL_TIM_GET_FLAG(io->htim, TIM_FLAG_CC1))
+		modbus_io_1_5_char_handler(io);
+	else if(__HAL_TIM_GET_FLAG(io->htim, TIM_FLAG_CC2))
+		modbus_io_3_5_char_handler(io);
+	else if(__HAL_TIM_GET_FLAG(io->htim, TIM_FLAG_CC3) && io->htim->Instance->DIER & TIM_DIER_CC3IE)
+		modbus_io_min_reply_handler(io);
+	else if(__HAL_TIM_GET_FLAG(io->htim, TIM_FLAG_CC4) && io->htim->Instance->DIER & TIM_DIER_CC4IE)
+		modbus_io_max_reply_handler(io);
 }
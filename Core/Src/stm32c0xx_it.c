@@ -23,7 +23,7 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "debug.h"
-#include "modbus_io.h"
+#include "modbus_controller.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -61,7 +61,8 @@ extern TIM_HandleTypeDef htim2;
 extern UART_HandleTypeDef huart1;
 extern UART_HandleTypeDef huart2;
 /* USER CODE BEGIN EV */
-
+extern modbus_io_t modbus_io_1;
+extern modbus_server_t modbus_server_1;
 /* USER CODE END EV */
 
 /******************************************************************************/
@@ -116,6 +117,9 @@ void SVC_Handler(void)
 void PendSV_Handler(void)
 {
   /* USER CODE BEGIN PendSV_IRQn 0 */
+#if MODBUS_IO_PENDSV
+	while(modbus_controller_tick(&modbus_server_1));	// Works through every queued frame, port interrupts pend it again for later ones
+#endif
 
   /* USER CODE END PendSV_IRQn 0 */
   /* USER CODE BEGIN PendSV_IRQn 1 */
@@ -150,10 +154,7 @@ void SysTick_Handler(void)
 void TIM2_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM2_IRQn 0 */
-	if(__HAL_TIM_GET_FLAG(&htim2, TIM_FLAG_CC1))
-		modbus_io_1_5_char_handler();
-	else if(__HAL_TIM_GET_FLAG(&htim2, TIM_FLAG_CC2))
-		modbus_io_3_5_char_handler();
+	modbus_io_tim_irq_handler(&modbus_io_1);
   /* USER CODE END TIM2_IRQn 0 */
   /* USER CODE BEGIN TIM2_IRQn 1 */
 
@@ -166,10 +167,7 @@ void TIM2_IRQHandler(void)
 void USART1_IRQHandler(void)
 {
   /* USER CODE BEGIN USART1_IRQn 0 */
-	if(__HAL_UART_GET_FLAG(&huart1, UART_FLAG_TC) && huart1.Instance->CR1 & USART_CR1_TCIE)
-		modbus_io_tc_handler();
-	if(__HAL_UART_GET_FLAG(&huart1, UART_FLAG_RXNE) && huart1.Instance->CR1 & USART_CR1_RXNEIE_RXFNEIE)
-		modbus_io_rx_ne_handler();
+	modbus_io_usart_irq_handler(&modbus_io_1);
   /* USER CODE END USART1_IRQn 0 */
   /* USER CODE BEGIN USART1_IRQn 1 */
 
@@ -0,0 +1,239 @@
+// Software CRC engine selected by MODBUS_CRC_ENGINE against a bit at a time CRC-16/MODBUS, over random lengths & offsets, whole frames
+// and MODBUS_CRC_UPDATE() byte by byte as interrupt handlers use it. Built once per engine.
+// With "bench" it reports table footprint and throughput in ns/byte instead, and bytes per TSC cycle on x86. Host figures, table footprint is the same on the M0+
+// The MODBUS_CRC_HARDWARE build runs modbus_crc() against a bit level model of the CRC unit instead, so byte & word feed order and REV_IN
+// are checked against modbus_crc_software(). Its "bench" estimates M0+ cycles for 256 byte frames from the data register writes it counts
+
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>	// Ahead of CMSIS, whose __I & __O macros it would trip over
+#define TSC	// Cycle counter to report bytes/cycle with, ns/byte is reported everywhere
+#endif
+#include "modbus_crc.h"
+#include "host_test.h"
+
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_HARDWARE
+#define ENGINE "CRC unit"
+#define TABLE_BYTES 0
+#elif MODBUS_CRC_ENGINE == MODBUS_CRC_NIBBLE
+#define ENGINE "nibble"
+#define TABLE_BYTES sizeof(modbus_crc_nibble_table)
+#elif MODBUS_CRC_ENGINE == MODBUS_CRC_SLICE_BY_4
+#define ENGINE "slice-by-4"
+#define TABLE_BYTES (sizeof(modbus_crc_table) + sizeof(modbus_crc_slice_tables))
+#else
+#define ENGINE "byte"
+#define TABLE_BYTES sizeof(modbus_crc_table)
+#endif
+
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_HARDWARE
+// CRC unit as RM0490 describes it: MSB first shift register POLYSIZE bits wide, input bit reversed per REV_IN unit before it's shifted in,
+// output bit reversed over the polynomial width with REV_OUT. RESET reloads INIT and clears itself
+static uint32_t unit_crc, unit_byte_writes, unit_word_writes;
+
+static uint32_t reflect(uint32_t value, uint8_t bits) {
+	uint32_t reflected = 0;
+
+	for(uint8_t i = 0; i < bits; ++i)
+		reflected |= ((value >> i) & 1) << (bits - 1 - i);
+
+	return reflected;
+}
+
+static uint8_t unit_width(void) {
+	switch(CRC->CR & CRC_CR_POLYSIZE) {
+		case 0: 				return 32;
+		case CRC_CR_POLYSIZE_0: return 16;
+		case CRC_CR_POLYSIZE_1: return 8;
+		default: 				return 7;
+	}
+}
+
+static uint32_t unit_mask(void) {
+	return (unit_width() == 32) ? UINT32_MAX : (1U << unit_width()) - 1;
+}
+
+static void unit_reset_pending(void) {
+	if(CRC->CR & CRC_CR_RESET) {
+		CRC->CR &= ~CRC_CR_RESET;
+		unit_crc = CRC->INIT & unit_mask();
+	}
+}
+
+static void unit_feed(uint32_t data, uint8_t bits) {
+	unit_reset_pending();
+
+	uint32_t rev_in = (CRC->CR & CRC_CR_REV_IN) >> CRC_CR_REV_IN_Pos;
+	if(rev_in) {
+		uint8_t unit = 4 << rev_in, reversed_bits = 0;	// Byte, half word or word
+		uint32_t reversed = 0;
+
+		if(unit > bits)
+			unit = bits;
+		for(; reversed_bits < bits; reversed_bits += unit)
+			reversed |= reflect(data >> reversed_bits, unit) << reversed_bits;
+
+		data = reversed;
+	}
+
+	uint32_t top = 1U << (unit_width() - 1);
+	for(int8_t i = bits - 1; i >= 0; --i) {
+		uint32_t feedback = ((unit_crc & top) != 0) ^ ((data >> i) & 1);
+
+		unit_crc = (unit_crc << 1) & unit_mask();
+		if(feedback)
+			unit_crc ^= CRC->POL & unit_mask();
+	}
+}
+
+void host_crc_write_8(uint8_t data) {
+	++unit_byte_writes;
+	unit_feed(data, 8);
+}
+
+void host_crc_write_32(uint32_t data) {
+	++unit_word_writes;
+	unit_feed(data, 32);
+}
+
+uint32_t host_crc_read(void) {
+	unit_reset_pending();
+
+	return (CRC->CR & CRC_CR_REV_OUT) ? reflect(unit_crc, unit_width()) : unit_crc;
+}
+#endif
+
+static uint16_t reference_crc(const uint8_t *data, uint16_t length) {
+	uint16_t crc = 0xFFFF;
+
+	while(length--) {
+		crc ^= *data++;
+		for(uint8_t i = 0; i < 8; ++i)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+
+	return crc;
+}
+
+static int test(void) {
+	uint32_t state = 0xC4C4C4C4;
+	uint8_t data[256 + 8];
+
+	for(uint8_t offset = 0; offset < 4; ++offset) {	// Every alignment, CRC unit is fed bytes up to a word boundary
+		memcpy(&data[offset], "123456789", 9);
+		if((modbus_crc_software(&data[offset], 9) != 0x4B37) || (modbus_crc(&data[offset], 9) != 0x4B37)) {
+			printf("%s: check value at offset %u is %04X, not 4B37\n", ENGINE, offset, modbus_crc(&data[offset], 9));
+			return 1;
+		}
+	}
+
+	for(uint32_t round = 0; round < 200000; ++round) {
+		uint16_t length = next_random(&state) % 257, offset = next_random(&state) % 8;
+		for(uint16_t i = 0; i < length; ++i)
+			data[offset + i] = next_random(&state);
+
+		uint16_t expected = reference_crc(&data[offset], length), per_byte = 0xFFFF;
+		for(uint16_t i = 0; i < length; ++i)
+			per_byte = MODBUS_CRC_UPDATE(per_byte, data[offset + i]);
+
+		if((modbus_crc_software(&data[offset], length) != expected) || (modbus_crc(&data[offset], length) != expected) || (per_byte != expected)) {
+			printf("%s: %u bytes at offset %u differ from reference\n", ENGINE, length, offset);
+			return 1;
+		}
+
+		if(length + 2 <= 256) {	// Frame with its CRC appended comes out 0
+			data[offset + length] = expected & 0xFF;
+			data[offset + length + 1] = expected >> 8;
+			if((modbus_crc_software(&data[offset], length + 2) != 0) || (modbus_crc(&data[offset], length + 2) != 0)) {
+				printf("%s: %u byte frame with its CRC doesn't check out\n", ENGINE, length + 2);
+				return 1;
+			}
+		}
+	}
+
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_HARDWARE
+	if(!unit_word_writes) {
+		printf("%s: never fed a word\n", ENGINE);
+		return 1;
+	}
+#endif
+
+	printf("%s: 200000 random spans match\n", ENGINE);
+	return 0;
+}
+
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_HARDWARE
+// M0+ cycles per step of modbus_crc() & modbus_crc_software() loops, counted from ARMv6-M instruction timings: loads & stores 2, taken branch 2, rest 1
+#define WORD_WRITE_CYCLES	10	// ldr, rev, str, adds, subs, cmp, bhi. Unit takes 4 HCLK a word, so the next store never waits for it
+#define BYTE_WRITE_CYCLES	8	// ldrb, strb, adds, subs, bne
+#define TABLE_BYTE_CYCLES	13	// MODBUS_CRC_BYTE: ldrb, eors, uxtb, lsls, ldrh, lsrs, eors, adds, cmp, bne
+
+static void bench(void) {
+	static uint8_t frame[256 + 4];
+
+	for(uint8_t offset = 0; offset < 4; ++offset) {
+		unit_byte_writes = unit_word_writes = 0;
+		modbus_crc(&frame[offset], 256);
+
+		uint32_t unit = unit_word_writes * WORD_WRITE_CYCLES + unit_byte_writes * BYTE_WRITE_CYCLES, table = 256 * TABLE_BYTE_CYCLES;
+		printf("  256 B frame at offset %u: %2u words + %u bytes written, M0+ estimate %4u cycles on %s vs %4u on byte table, %.1fx\n",
+			   offset, unit_word_writes, unit_byte_writes, unit, ENGINE, table, (double)table / unit);
+	}
+}
+#else
+static void bench(void) {
+	static uint8_t frame[256];
+	uint32_t state = 0xB0B0B0B0;
+	for(uint16_t i = 0; i < sizeof(frame); ++i)
+		frame[i] = next_random(&state);
+
+	printf("  %-10s tables %4u bytes,", ENGINE, (unsigned)TABLE_BYTES);
+
+	static const uint16_t lengths[] = {8, 64, 256};
+	for(uint8_t l = 0; l < 3; ++l) {
+		uint16_t length = lengths[l];
+		uint32_t calls = 50000000 / length;
+		volatile uint16_t sink;
+
+		uint64_t start = now_ns();
+#ifdef TSC
+		uint64_t start_cycles = __rdtsc();
+#endif
+		for(uint32_t i = 0; i < calls; ++i)
+			sink = modbus_crc_software(frame, length);
+#ifdef TSC
+		uint64_t cycles = __rdtsc() - start_cycles;
+#endif
+		uint64_t ns = now_ns() - start;
+		(void)sink;
+
+		printf(" %3u B frames %.2f ns/byte", length, (double)ns / ((double)length * calls));
+#ifdef TSC
+		printf(" %.2f bytes/cycle", (double)length * calls / cycles);
+#endif
+		printf((l == 2) ? "\n" : ",");
+	}
+}
+#endif
+
+int main(int argc, char **argv) {
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_HARDWARE
+	if(mmap((void*)AHBPERIPH_BASE, 0x4000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void*)AHBPERIPH_BASE) {
+		printf("can't map RCC & CRC unit at %08lX\n", (unsigned long)AHBPERIPH_BASE);	// RCC for clock enable
+		return 1;
+	}
+#endif
+
+	modbus_crc_init();
+
+	if((argc > 1) && !strcmp(argv[1], "bench")) {
+		bench();
+		return 0;
+	}
+
+	if(test())
+		return 1;
+
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef HOST_H
+#define HOST_H
+
+// Forced into every host build. Firmware sources get their CMSIS intrinsics renamed to these by the Makefile, the ARM originals can't be assembled here
+
+#include <stdint.h>
+
+static inline void host_DMB(void) {
+	__sync_synchronize();
+}
+
+static inline uint32_t host_REV16(uint32_t value) {	// bswap & rotate, as close to the M0+'s single instruction as x86 gets
+	value = __builtin_bswap32(value);
+
+	return (value >> 16) | (value << 16);
+}
+
+static inline uint32_t host_REV(uint32_t value) {
+	return __builtin_bswap32(value);
+}
+
+// CRC unit's data register computes on every access, so the MODBUS_CRC_HARDWARE build sends its accesses to the model in crc_test.c
+void host_crc_write_8(uint8_t data);
+void host_crc_write_32(uint32_t data);
+uint32_t host_crc_read(void);
+
+// Single threaded apart from modbus_io_queue_test, whose "interrupts" run on their own thread and never need masking
+static inline uint32_t host_get_PRIMASK(void) {
+	return 0;
+}
+
+static inline void host_set_PRIMASK(uint32_t primask) {
+	(void)primask;
+}
+
+static inline void host_disable_irq(void) {
+}
+
+static inline void host_enable_irq(void) {
+}
+
+#endif
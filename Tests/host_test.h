@@ -0,0 +1,41 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+// Helpers shared by the host tests
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline uint32_t next_random(uint32_t *state) {	// xorshift32, state must not be 0
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+static inline uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+// size bytes ending right before an inaccessible page, so reading past them faults. Never freed
+static inline uint8_t *guarded(size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE), span = ((size + page - 1) / page + 1) * page;
+	uint8_t *base = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(base == MAP_FAILED)
+		abort();
+
+	mprotect(base + span - page, page, PROT_NONE);
+
+	return base + span - page - size;
+}
+
+#endif
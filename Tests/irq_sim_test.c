@@ -0,0 +1,483 @@
+// Interrupts per received frame for the MODBUS_IO_RX_MODE it's built with, at 9600, 115200 & 1M baud.
+// Peripheral address space is mapped to plain memory at its real address, so modbus_io_init() & the IRQ handlers run untouched against it.
+// The simulation steps one bit time at a time and plays what USART1, TIM2 & DMA1 channel 1 would do: bytes landing in RDR or through DMA,
+// receiver timeout, compare matches, one pulse mode, and write 1 to clear / write 0 to clear flag semantics.
+// RX_DMA also has to keep a byte that lands while its receiver timeout handler has DMA stopped, and flush the one an overlong frame leaves in RDR.
+// Built with MODBUS_IO_MUTE_FOREIGN_FRAMES, a frame for another unit ID mutes the USART until the line goes idle, and its end must still be timed.
+// Built with MODBUS_IO_PENDSV it also replies to requests, and compares turnaround jitter and how often Modbus code runs per request when
+// serving them from PendSV, from a main loop sleeping in WFI as main.c does, one spinning on the tick, and one busy with other work in between. Linked without PIE so buffers sit below 4G, where a 32 bit DMA address register can point at them
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "modbus_io.h"
+
+#define KERNEL_FREQ 48000000
+#define BITS_PER_CHAR 10	// 8N1
+#define FRAMES 20
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+#define MODE "RX_DMA"
+#elif MODBUS_IO_RX_MODE == MODBUS_IO_RX_TIMER
+#define MODE "RX_TIMER"
+#else
+#error "FIFO mode pops RDR on read, which plain memory can't model"
+#endif
+
+static UART_HandleTypeDef huart;
+static TIM_HandleTypeDef htim;
+static modbus_io_t io;
+
+static uint32_t interrupts, idle_bits, transmit_bits;
+static int late_byte = -1;	// Lands in RDR just as next receiver timeout handler starts, after it has stopped DMA
+static bool muted;	// Bytes don't reach RDR until a whole idle character
+
+#define TDR_UNWRITTEN 0x100	// Out of range for a byte, tells whether a handler wrote TDR
+
+#if MODBUS_IO_PENDSV
+#define WORK_US 1000	// Main loop's slices of other work, it only polls Modbus in between
+
+typedef enum { SERVE_NOTHING, SERVE_SPIN, SERVE_WFI, SERVE_MAIN_LOOP, SERVE_PENDSV } serving;	// Interrupt counts are taken with nothing served
+
+static serving served_from;
+static uint32_t bit_clock, work_bits, replies, runs, slept_at;
+static bool asleep;
+
+static void serve(void);
+static void thread(void);
+#endif
+
+static void dma_request(void) {	// USART holds request while RXNE is set, channel serves it whenever it's enabled and has room
+	DMA_Channel_TypeDef *dma = DMA1_Channel1;
+
+	if((USART1->ISR & USART_ISR_RXNE_RXFNE) && (USART1->CR3 & USART_CR3_DMAR) && (dma->CCR & DMA_CCR_EN) && dma->CNDTR) {
+		((uint8_t*)(uintptr_t)dma->CMAR)[MODBUS_IO_BUFFER_SIZE - dma->CNDTR] = USART1->RDR;
+		--dma->CNDTR;
+		USART1->ISR &= ~USART_ISR_RXNE_RXFNE;
+	}
+}
+
+static void service_usart(void) {
+	for(;;) {
+		uint32_t rxne = (USART1->ISR & USART_ISR_RXNE_RXFNE) && (USART1->CR1 & USART_CR1_RXNEIE_RXFNEIE);
+		uint32_t rto = (USART1->ISR & USART_ISR_RTOF) && (USART1->CR1 & USART_CR1_RTOIE);
+		uint32_t tc = (USART1->ISR & USART_ISR_TC) && (USART1->CR1 & USART_CR1_TCIE);
+		if(!rxne && !rto && !tc)
+			return;
+
+		if(rto && (late_byte >= 0)) {
+			USART1->RDR = late_byte;
+			USART1->ISR |= USART_ISR_RXNE_RXFNE;
+			late_byte = -1;
+		}
+
+		++interrupts;
+		USART1->TDR = TDR_UNWRITTEN;
+		modbus_io_usart_irq_handler(&io);
+
+		if(USART1->TDR != TDR_UNWRITTEN) {	// Writing TDR clears TC until byte has gone out
+			USART1->ISR &= ~USART_ISR_TC;
+			transmit_bits = BITS_PER_CHAR;
+		}
+		if(rxne)
+			USART1->ISR &= ~USART_ISR_RXNE_RXFNE;	// Handler read RDR
+		USART1->ISR &= ~USART1->ICR;
+		USART1->ICR = 0;
+		if(USART1->RQR & USART_RQR_RXFRQ)
+			USART1->ISR &= ~USART_ISR_RXNE_RXFNE;
+		if((USART1->RQR & USART_RQR_MMRQ) && (USART1->CR1 & USART_CR1_MME))
+			muted = true;
+		USART1->RQR = 0;
+
+		dma_request();
+	}
+}
+
+static void service_timer(void) {
+	const uint32_t channels = TIM_SR_CC1IF | TIM_SR_CC2IF | TIM_SR_CC3IF | TIM_SR_CC4IF;
+
+	while(TIM2->SR & TIM2->DIER & channels) {
+		uint32_t before = TIM2->SR;
+
+		++interrupts;
+		modbus_io_tim_irq_handler(&io);
+
+		TIM2->SR &= before;	// Writes can only clear
+	}
+}
+
+static void tick(void) {	// One bit time
+	if(TIM2->CR1 & TIM_CR1_CEN) {
+		uint32_t count = ++TIM2->CNT;
+
+		if(count == TIM2->CCR1) TIM2->SR |= TIM_SR_CC1IF;
+		if(count == TIM2->CCR2) TIM2->SR |= TIM_SR_CC2IF;
+		if(count == TIM2->CCR3) TIM2->SR |= TIM_SR_CC3IF;
+		if(count == TIM2->CCR4) TIM2->SR |= TIM_SR_CC4IF;
+
+		if(count == TIM2->ARR) {
+			TIM2->CNT = 0;
+			TIM2->SR |= TIM_SR_UIF;
+			if(TIM2->CR1 & TIM_CR1_OPM)
+				TIM2->CR1 &= ~TIM_CR1_CEN;
+		}
+	}
+
+	if((USART1->CR2 & USART_CR2_RTOEN) && (++idle_bits == (USART1->RTOR & USART_RTOR_RTO)))
+		USART1->ISR |= USART_ISR_RTOF;
+	if(idle_bits > BITS_PER_CHAR)	// Bits of a character that follows straight on aren't idle
+		muted = false;
+
+	if(transmit_bits && !--transmit_bits)
+		USART1->ISR |= USART_ISR_TC;
+
+	service_timer();
+	service_usart();
+
+#if MODBUS_IO_PENDSV
+	++bit_clock;
+	thread();
+#endif
+}
+
+static void receive(uint8_t byte) {	// Stop bit just ended
+	if(!muted && !(USART1->ISR & USART_ISR_RXNE_RXFNE)) {	// Otherwise muted, or previous byte is still unread and lost. ORE isn't raised,
+		USART1->RDR = byte;							// plain memory ICR only keeps handler's last write so it could never be cleared
+		USART1->ISR |= USART_ISR_RXNE_RXFNE;
+	}
+
+	idle_bits = 0;
+	dma_request();
+	service_usart();
+
+#if MODBUS_IO_PENDSV
+	thread();
+#endif
+}
+
+static void send(const uint8_t *bytes, uint16_t count) {
+	for(uint16_t i = 0; i < count; ++i) {
+		for(uint8_t bit = 0; bit < BITS_PER_CHAR; ++bit)
+			tick();
+
+		receive(bytes[i]);
+	}
+}
+
+static void start(uint32_t baud) {
+	memset((void*)PERIPH_BASE, 0, 0x30000);
+	memset(&io, 0, sizeof(io));
+	transmit_bits = 0;
+	muted = false;
+
+	USART1->BRR = KERNEL_FREQ / baud;
+	USART1->ISR = USART_ISR_TC;	// Reset value, nothing to send
+	USART1->CR1 = USART_CR1_UE | USART_CR1_RE | USART_CR1_TE;
+	TIM2->CR1 = TIM_CR1_OPM;	// As MX_TIM2_Init() leaves it
+	huart.Instance = USART1;
+	huart.Init.WordLength = UART_WORDLENGTH_8B;
+	huart.Init.StopBits = UART_STOPBITS_1;
+	huart.Init.Parity = UART_PARITY_NONE;
+	huart.Init.ClockPrescaler = UART_PRESCALER_DIV1;
+	htim.Instance = TIM2;
+
+	modbus_io_init(&io, &huart, KERNEL_FREQ, &htim, KERNEL_FREQ, 0, 0, 0, 0);
+}
+
+static int run(uint32_t baud, uint16_t frame_bytes, double *per_frame, double *per_second) {
+	start(baud);
+
+	uint32_t gap = TIM2->CCR2 + 2 * BITS_PER_CHAR;	// Just past 3.5 character time between frames
+	uint32_t received = 0, state = 1;
+
+	interrupts = 0;
+
+	for(uint16_t frame = 0; frame < FRAMES; ++frame) {
+		uint8_t bytes[MODBUS_IO_BUFFER_SIZE] = {1};	// Unit ID 1, then anything
+		for(uint16_t i = 1; i < frame_bytes; ++i) {
+			state = state * 1103515245 + 12345;
+			bytes[i] = state >> 16;
+		}
+
+		send(bytes, frame_bytes);
+
+		for(uint32_t bit = 0; bit < gap; ++bit)
+			tick();
+
+		uint8_t *data;
+		uint16_t size;
+		while((size = modbus_io_borrow(&io, &data)) > 0) {	// Application keeps up
+			received += size == frame_bytes;
+			modbus_io_return(&io, data);
+		}
+	}
+
+	if(received != FRAMES) {
+		printf(MODE " at %u baud: %u of %u %u byte frames came through\n", baud, received, FRAMES, frame_bytes);
+		return 1;
+	}
+
+	*per_frame = (double)interrupts / FRAMES;
+	*per_second = *per_frame * baud / (frame_bytes * BITS_PER_CHAR + gap);	// Line busy with back to back frames
+	return 0;
+}
+
+#if (MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA) || MODBUS_IO_MUTE_FOREIGN_FRAMES
+static int expect_frame(const uint8_t *bytes, uint16_t count, const char *what) {
+	uint8_t *data;
+	uint16_t size = modbus_io_borrow(&io, &data);
+
+	if((size != count) || memcmp(data, bytes, count)) {
+		printf("  " MODE " %s: got %u byte frame, not the %u bytes sent\n", what, size, count);
+		return 1;
+	}
+
+	modbus_io_return(&io, data);
+	return 0;
+}
+#endif
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+
+// Receiver timeout handler stops DMA while it swaps buffers. A byte landing meanwhile belongs to the next frame and must survive,
+// only a frame longer than the buffer leaves a stale byte in RDR to flush
+static int dma_edges(void) {
+	static const uint8_t request[8] = {1, 3, 0, 0, 0, 4, 0x44, 0x09};
+	uint8_t overlong[300];
+	uint32_t failures = 0;
+
+	start(115200);
+	uint32_t gap = TIM2->CCR2 + 2 * BITS_PER_CHAR;
+
+	memset(overlong, 0x55, sizeof(overlong));
+	overlong[0] = 1;
+	send(overlong, sizeof(overlong));
+	for(uint32_t bit = 0; bit < gap; ++bit)
+		tick();
+
+	uint8_t *data;
+	if(modbus_io_borrow(&io, &data) == MODBUS_IO_BUFFER_SIZE)	// Truncated, CRC check drops it
+		modbus_io_return(&io, data);
+
+	send(request, sizeof(request));
+	for(uint32_t bit = 0; bit < gap; ++bit)
+		tick();
+	failures += expect_frame(request, sizeof(request), "frame after an overlong one");
+
+	send(request, sizeof(request));
+	for(uint32_t bit = 0; bit < TIM2->CCR2 - 1; ++bit)	// Next frame starts right as receiver timeout fires
+		tick();
+	late_byte = request[0];
+	for(uint32_t bit = 0; bit < BITS_PER_CHAR; ++bit)
+		tick();
+	if(late_byte >= 0) {
+		printf("  " MODE " receiver timeout never fired\n");
+		return 1;
+	}
+	send(&request[1], sizeof(request) - 1);
+	for(uint32_t bit = 0; bit < gap; ++bit)
+		tick();
+	failures += expect_frame(request, sizeof(request), "frame before one starting in its timeout handler");
+	failures += expect_frame(request, sizeof(request), "frame starting in previous one's timeout handler");
+
+	if(!failures)
+		printf("  " MODE " bytes landing while receiver timeout handler runs and after overlong frames come through\n");
+
+	return failures;
+}
+#endif
+
+#if MODBUS_IO_MUTE_FOREIGN_FRAMES
+// Muted bytes never raise RXNE. Frame for another unit ID mustn't look over partway through, a reply or format switch would land in it
+static int mute_edges(void) {
+	static const uint8_t request[8] = {1, 3, 0, 0, 0, 1, 0x84, 0x0A};
+	uint8_t foreign[64];
+
+	start(115200);
+	modbus_io_filter_address(&io, 1);
+	uint32_t gap = TIM2->CCR2 + 2 * BITS_PER_CHAR;
+
+	memset(foreign, 0x55, sizeof(foreign));
+	foreign[0] = 2;
+	interrupts = 0;
+
+	for(uint16_t i = 0; i < sizeof(foreign); ++i) {
+		send(&foreign[i], 1);
+		if(io.frame_end) {
+			printf("  " MODE " muted frame ended after %u of its %u bytes\n", i + 1, (unsigned)sizeof(foreign));
+			return 1;
+		}
+	}
+	for(uint32_t bit = 0; bit < gap; ++bit)
+		tick();
+
+	if(!io.frame_end || (interrupts != 2)) {	// First byte's RXNE & receiver timeout
+		printf("  " MODE " muted frame took %u interrupts and %s\n", interrupts, io.frame_end ? "ended" : "never ended");
+		return 1;
+	}
+
+	send(request, sizeof(request));
+	for(uint32_t bit = 0; bit < gap; ++bit)
+		tick();
+	if(expect_frame(request, sizeof(request), "frame after a muted one"))
+		return 1;
+
+	printf("  " MODE " muted %u byte frame for another unit ID: 2 interrupts, timed to its end\n", (unsigned)sizeof(foreign));
+	return 0;
+}
+#endif
+
+#if MODBUS_IO_PENDSV
+static void serve(void) {	// Stand-in for modbus_controller_tick(), answers each request with a fixed reply
+	static uint8_t reply[7] = {1, 3, 2, 0, 0, 0xB8, 0x44};
+	uint8_t *data;
+
+	while(modbus_io_borrow(&io, &data) > 0) {
+		replies += modbus_io_write(&io, reply, sizeof(reply)) == sizeof(reply);
+		modbus_io_return(&io, data);
+	}
+}
+
+static void thread(void) {	// Runs after interrupts have been served
+	bool pended = SCB->ICSR & SCB_ICSR_PENDSVSET_Msk;
+	SCB->ICSR = 0;
+
+	switch(served_from) {
+		case SERVE_NOTHING:
+			return;
+		case SERVE_SPIN:	// Once per bit here, thousands of times on the chip
+			break;
+		case SERVE_WFI:
+			if(asleep && (interrupts == slept_at))	// Only an interrupt wakes it
+				return;
+			break;
+		case SERVE_MAIN_LOOP:
+			if(bit_clock % work_bits)	// Still busy with a slice of work
+				return;
+			break;
+		case SERVE_PENDSV:
+			if(!pended)	// Otherwise it tail chains off port interrupt, preempting whatever main loop is busy with
+				return;
+			break;
+	}
+
+	++runs;
+	do
+		serve();
+	while(modbus_io_ready(&io));	// Sleeps only with nothing left to do
+
+	asleep = true;
+	slept_at = interrupts;
+}
+
+// Turnaround is counted by modbus_io from request's 3.5 character time, so its spread is how far serving jitters. PendSV and WFI wake-up run
+// as soon as port interrupt returns, a busy main loop only once its current slice of work is done. Bit resolution, so PendSV entry and
+// wake-up from Sleep, a few cycles each, don't show
+static int jitter(uint32_t baud, serving from, const char *name) {
+	static uint8_t request[8] = {1, 3, 0, 0, 0, 1, 0x84, 0x0A};
+	uint32_t state = 7;
+
+	start(baud);
+	served_from = from;
+	work_bits = (uint64_t)WORK_US * baud / 1000000;
+	if(work_bits == 0)
+		work_bits = 1;
+	bit_clock = replies = runs = 0;
+	asleep = false;
+
+	uint32_t gap = TIM2->CCR2 + 2 * BITS_PER_CHAR;
+
+	for(uint16_t frame = 0; frame < 10 * FRAMES; ++frame) {
+		send(request, sizeof(request));
+
+		for(uint32_t bit = 0; (replies <= frame) || modbus_io_write_busy(&io); ++bit) {
+			if(bit > 2 * (work_bits + gap)) {
+				printf("  %s at %u baud: request %u never answered\n", name, baud, frame);
+				return 1;
+			}
+			tick();
+		}
+
+		state = state * 1103515245 + 12345;	// Requests land at any point of main loop's slice
+		for(uint32_t bit = gap + (state >> 16) % work_bits; bit > 0; --bit)
+			tick();
+	}
+
+	modbus_io_turnaround_stats stats;
+	modbus_io_turnaround(&io, &stats);
+
+	served_from = SERVE_NOTHING;
+	printf("  %-9s %7u baud: turnaround %4u-%4u bits, jitter %4u bits %7.1f us, Modbus code runs %6.1f times/request\n",
+		   name, baud, stats.min, stats.max, stats.max - stats.min, (stats.max - stats.min) * 1e6 / baud, (double)runs / (10 * FRAMES));
+
+	if((from != SERVE_MAIN_LOOP) && (stats.max != 0)) {
+		printf("  %s serving is late\n", name);
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+int main(void) {
+	if(mmap((void*)PERIPH_BASE, 0x30000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void*)PERIPH_BASE) {
+		printf("can't map peripherals at %08lX\n", (unsigned long)PERIPH_BASE);
+		return 1;
+	}
+#if MODBUS_IO_PENDSV
+	if(mmap((void*)SCS_BASE, 0x1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void*)SCS_BASE) {
+		printf("can't map system control space at %08lX\n", (unsigned long)SCS_BASE);
+		return 1;
+	}
+#endif
+
+	static const uint32_t bauds[] = {9600, 115200, 1000000};
+	static const uint16_t sizes[] = {8, 64, 256 - 1};	// Read request, mid sized write, near full buffer
+	uint32_t failures = 0;
+
+	for(uint8_t b = 0; b < 3; ++b)
+		for(uint8_t s = 0; s < 3; ++s) {
+			double per_frame, per_second;
+			if(run(bauds[b], sizes[s], &per_frame, &per_second)) {
+				++failures;
+				continue;
+			}
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+			double expected = 1;	// Receiver timeout only
+#else
+			double expected = sizes[s] + 2;	// RXNE per byte, CC1 & CC2
+#endif
+			printf("  " MODE " %7u baud, %3u byte frames: %5.1f interrupts/frame, %7.0f/s on a busy line\n",
+				   bauds[b], sizes[s], per_frame, per_second);
+
+			if(per_frame != expected) {
+				printf("  expected %.0f interrupts/frame\n", expected);
+				++failures;
+			}
+		}
+
+#if MODBUS_IO_RX_MODE == MODBUS_IO_RX_DMA
+	failures += dma_edges();
+#endif
+
+#if MODBUS_IO_MUTE_FOREIGN_FRAMES
+	failures += mute_edges();
+#endif
+
+#if MODBUS_IO_PENDSV
+	for(uint8_t b = 0; b < 3; ++b) {
+		failures += jitter(bauds[b], SERVE_SPIN, "spin");
+		failures += jitter(bauds[b], SERVE_WFI, "WFI");
+		failures += jitter(bauds[b], SERVE_MAIN_LOOP, "main loop");	// 1 ms work slices
+		failures += jitter(bauds[b], SERVE_PENDSV, "PendSV");
+	}
+#endif
+
+	if(failures) {
+		printf("FAIL\n");
+		return 1;
+	}
+
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,177 @@
+// Frame queue stress test. A second thread plays the port interrupts, receiving bytes, publishing frames at 1.5 character time
+// and then either confirming or withdrawing them, while main thread borrows & returns frames as the application would.
+// Every confirmed frame that made it into the queue must come out once, in order, intact. Withdrawn ones may come out too,
+// application can borrow a tentative frame before it's withdrawn, but never out of order
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "modbus_io.h"
+#include "modbus_crc.h"
+#include "host_test.h"
+
+#define FRAMES 300000
+
+// ISR side internals, not in modbus_io.h
+void receive_byte(modbus_io_t *io, uint8_t byte);
+void publish_frame(modbus_io_t *io);
+void withdraw_tentative(modbus_io_t *io);
+uint8_t next_frame(uint8_t index);
+
+#define MODBUS_IO_NO_FRAME 0xFF	// As in modbus_io.c
+
+enum { DROPPED, CONFIRMED, WITHDRAWN };
+
+static modbus_io_t io;
+static uint8_t outcome[FRAMES];	// Written by ISR thread, read after join
+static volatile int isr_done;
+
+static uint8_t build_frame(uint32_t seq, uint32_t *state, uint8_t *frame) {	// Unit ID, sequence number, filler derived from it, CRC
+	uint8_t size = 8 + next_random(state) % 56;
+
+	frame[0] = 1;
+	memcpy(&frame[1], &seq, sizeof(seq));
+	for(uint8_t i = 5; i < size - 2; ++i)
+		frame[i] = (uint8_t)(seq * 31 + i);
+
+	uint16_t crc = modbus_crc_software(frame, size - 2);
+	frame[size - 2] = crc & 0xFF;
+	frame[size - 1] = crc >> 8;
+
+	return size;
+}
+
+static void *isr_thread(void *arg) {
+	uint32_t state = 0x12345678;
+	uint8_t frame[64];
+
+	for(uint32_t seq = 0; seq < FRAMES; ++seq) {
+		uint8_t size = build_frame(seq, &state, frame);
+
+		if(next_random(&state) % 8 != 0)	// Mostly a master waiting for replies, now and then a burst overrunning the queue
+			while(next_frame(io.frames_head) == io.frames_tail)
+				sched_yield();
+
+		for(uint8_t i = 0; i < size; ++i)
+			receive_byte(&io, frame[i]);
+
+		// 1.5 character time
+		uint8_t head = io.frames_head;
+		publish_frame(&io);
+
+		if(io.frames_head == head) {	// Queue full
+			outcome[seq] = DROPPED;
+			continue;
+		}
+
+		io.tentative_frame = head;
+
+		if(next_random(&state) % 2 == 0)	// Give application a chance at the tentative frame
+			sched_yield();
+
+		if(next_random(&state) % 4 == 0) {	// Line woke before 3.5
+			withdraw_tentative(&io);
+			outcome[seq] = WITHDRAWN;
+		}
+		else {	// 3.5 character time
+			io.tentative_frame = MODBUS_IO_NO_FRAME;
+			outcome[seq] = CONFIRMED;
+		}
+	}
+
+	isr_done = 1;
+
+	return NULL;
+}
+
+int main(void) {
+	static uint32_t seen[FRAMES + 1];
+	uint32_t seen_count = 0, failures = 0;
+
+	alarm(60);	// A slot neither side gives back stalls both, fail rather than hang
+
+	io.tentative_frame = MODBUS_IO_NO_FRAME;
+	io.receive_buffer = io.frames[0].data;
+
+	pthread_t isr;
+	pthread_create(&isr, NULL, isr_thread, NULL);
+
+	for(;;) {
+		int done = isr_done;	// Checked before borrowing, so a frame published just before finishing is still picked up
+
+		uint8_t *frame;
+		uint16_t size = modbus_io_borrow(&io, &frame);
+
+		if(size == 0) {
+			if(done)
+				break;
+
+			sched_yield();
+			continue;
+		}
+
+		bool crc_valid = modbus_io_crc_valid(&io);
+
+		uint32_t seq;
+		memcpy(&seq, &frame[1], sizeof(seq));
+
+		bool intact = (size >= 8) && (seq < FRAMES) && (modbus_crc_software(frame, size) == 0);
+		for(uint16_t i = 5; intact && (i < size - 2); ++i)
+			intact = frame[i] == (uint8_t)(seq * 31 + i);
+
+		if(!intact || !crc_valid) {
+			if(failures++ < 10)
+				printf("corrupt frame, size %u, crc_valid %d\n", size, crc_valid);
+		}
+		else if((seen_count > 0) && (seq <= seen[seen_count - 1])) {
+			if(failures++ < 10)
+				printf("frame %u out of order after %u\n", seq, seen[seen_count - 1]);
+		}
+		else
+			seen[seen_count++] = seq;
+
+		modbus_io_return(&io, frame);
+	}
+
+	pthread_join(isr, NULL);
+
+	uint32_t confirmed = 0, withdrawn = 0, dropped = 0, withdrawn_seen = 0, s = 0;
+	for(uint32_t seq = 0; seq < FRAMES; ++seq) {
+		bool was_seen = (s < seen_count) && (seen[s] == seq);
+		if(was_seen)
+			++s;
+
+		switch(outcome[seq]) {
+		case CONFIRMED:
+			++confirmed;
+			if(!was_seen && (failures++ < 10))
+				printf("confirmed frame %u lost\n", seq);
+			break;
+		case WITHDRAWN:
+			++withdrawn;
+			withdrawn_seen += was_seen;
+			break;
+		default:
+			++dropped;
+			if(was_seen && (failures++ < 10))
+				printf("dropped frame %u came out\n", seq);
+		}
+	}
+
+	if(dropped != io.frames_overflows)
+		printf("%u frames dropped, overflow count says %u\n", dropped, io.frames_overflows), ++failures;
+
+	printf("%u frames: %u confirmed, %u withdrawn (%u borrowed before withdrawal), %u dropped on a full queue\n",
+		   FRAMES, confirmed, withdrawn, withdrawn_seen, dropped);
+
+	if(failures) {
+		printf("FAIL, %u failures\n", failures);
+		return 1;
+	}
+
+	printf("PASS\n");
+	return 0;
+}
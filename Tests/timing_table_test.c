@@ -0,0 +1,95 @@
+// Inter-character timing for every supported baud rate, parity, stop bit & oversampling combination, going through apply_pending_format()
+// as modbus_io_reconfigure() does. Registers are plain structs here. CC1 & CC2 must be 1.5 & 3.5 character times rounded up to whole bits,
+// or 750 & 1750 us above 19200 baud with MODBUS_IO_SPEC_TIMEOUTS, and the time the timer actually takes to get there mustn't come out short
+
+#include <math.h>
+#include <stdio.h>
+#include "modbus_io.h"
+
+#define KERNEL_FREQ 48000000	// SYSCLK, USART1 & TIM2 kernels run off it undivided
+#define MIN_REPLY_BITS 10
+#define MAX_REPLY_BITS 300
+
+void apply_pending_format(modbus_io_t *io);
+
+static const uint32_t bauds[] = {1200, 2400, 4800, 9600, 14400, 19200, 38400, 57600, 115200, 230400, 460800, 921600};
+static const struct { uint32_t parity; const char *name; } parities[] = {{UART_PARITY_NONE, "N"}, {UART_PARITY_EVEN, "E"}, {UART_PARITY_ODD, "O"}};
+static const struct { uint32_t stop_bits; uint32_t half_bits; const char *name; } stops[] = {
+	{UART_STOPBITS_0_5, 1, "0.5"}, {UART_STOPBITS_1, 2, "1"}, {UART_STOPBITS_1_5, 3, "1.5"}, {UART_STOPBITS_2, 4, "2"}
+};
+
+int main(void) {
+	static USART_TypeDef usart;
+	static TIM_TypeDef tim;
+	static UART_HandleTypeDef huart = {.Instance = &usart};
+	static TIM_HandleTypeDef htim = {.Instance = &tim};
+	static modbus_io_t io;
+
+	io.huart = &huart;
+	io.htim = &htim;
+	io.counter_max = UINT32_MAX;
+	io.huart_kernel_freq = io.tim_kernel_freq = KERNEL_FREQ;
+	io.min_reply_bits = MIN_REPLY_BITS;
+	io.max_reply_bits = MAX_REPLY_BITS;
+
+	uint32_t failures = 0, combinations = 0;
+
+	for(uint8_t over8 = 0; over8 < 2; ++over8)
+		for(uint8_t b = 0; b < sizeof(bauds) / sizeof(bauds[0]); ++b)
+			for(uint8_t p = 0; p < sizeof(parities) / sizeof(parities[0]); ++p)
+				for(uint8_t s = 0; s < sizeof(stops) / sizeof(stops[0]); ++s) {
+					usart.CR1 = over8 ? USART_CR1_OVER8 : 0;
+					io.pending_baud = bauds[b];
+					io.pending_parity = parities[p].parity;
+					io.pending_stop_bits = stops[s].stop_bits;
+
+					apply_pending_format(&io);
+					++combinations;
+
+					uint32_t baud = io.huart->Init.BaudRate;	// What BRR actually gives
+					double bits = 1 + 8 + (parities[p].parity != UART_PARITY_NONE) + stops[s].half_bits / 2.0;	// Start, data, parity, stop
+					double need_1_5 = 1.5 * bits / bauds[b], need_3_5 = 3.5 * bits / bauds[b];	// Seconds, at nominal rate
+					uint32_t want_1_5 = ceil(1.5 * bits - 1e-9), want_3_5 = ceil(3.5 * bits - 1e-9);
+#if MODBUS_IO_SPEC_TIMEOUTS
+					if(baud > 19200) {
+						need_1_5 = 750e-6;
+						need_3_5 = 1750e-6;
+						want_1_5 = ceil(need_1_5 * baud - 1e-9);
+						want_3_5 = ceil(need_3_5 * baud - 1e-9);
+					}
+#endif
+					double tick = (double)(tim.PSC + 1) / KERNEL_FREQ, got_1_5 = tim.CCR1 * tick, got_3_5 = tim.CCR2 * tick;
+
+					const char *problem = NULL;
+					if(((double)baud < bauds[b] * 0.99) || ((double)baud > bauds[b] * 1.01))
+						problem = "BRR misses baud rate by over 1%";
+					else if((tim.CCR1 != want_1_5) || (tim.CCR2 != want_3_5))
+						problem = "CC1 / CC2 aren't character times rounded up";
+					else if((tim.CCR3 != want_3_5 + MIN_REPLY_BITS) || (tim.CCR4 != want_3_5 + MAX_REPLY_BITS) || (tim.ARR != tim.CCR4))
+						problem = "reply window isn't counted from 3.5 character time";
+					else if(usart.RTOR != want_3_5)
+						problem = "receiver timeout doesn't match 3.5 character time";
+					else if((got_1_5 < need_1_5 * 0.995) || (got_3_5 < need_3_5 * 0.995))	// Prescaler rounding may shave off a fraction of a percent
+						problem = "timer runs out early";
+					else if((got_1_5 > need_1_5 + 1.01 / bauds[b]) || (got_3_5 > need_3_5 + 1.01 / bauds[b]))
+						problem = "timer runs over a bit late";
+
+					if(problem) {
+						++failures;
+						printf("%u %s%s OVER%u: %s. PSC %u, CC1 %u (%u), CC2 %u (%u), %.1f / %.1f us\n", bauds[b], parities[p].name, stops[s].name,
+							   over8 ? 8 : 16, problem, tim.PSC, tim.CCR1, want_1_5, tim.CCR2, want_3_5, got_1_5 * 1e6, got_3_5 * 1e6);
+					}
+
+					if(!over8 && (s == 1) && (p < 2))	// Table of the two most common formats
+						printf("%6u 8%s1: t1.5 %4u bits %7.1f us, t3.5 %4u bits %7.1f us\n",
+							   bauds[b], parities[p].name, tim.CCR1, got_1_5 * 1e6, tim.CCR2, got_3_5 * 1e6);
+				}
+
+	if(failures) {
+		printf("FAIL, %u of %u combinations\n", failures, combinations);
+		return 1;
+	}
+
+	printf("%u combinations, PASS\n", combinations);
+	return 0;
+}